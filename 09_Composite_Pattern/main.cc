@@ -9,54 +9,376 @@
 #include <iostream>
 #include <vector>
 #include <algorithm>
+#include <random>
+#include <chrono>
+#include <cstdlib>
+#include <string>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
 using namespace std;
 
+class Picture;
+
+// A small work stealing thread pool
+// Each worker pops tasks from the back of its own queue and steals from the front of others
+class WorkStealingPool
+{
+private:
+    struct Queue
+    {
+        mutex lock;
+        deque<function<void()> > tasks;
+    };
+    vector<Queue*> queues;
+    vector<thread> workers;
+    atomic<bool> stop;
+    atomic<unsigned> next;
+    // Tasks in the queues, idle workers sleep until there are some
+    // Raised under sleepLock so a worker about to sleep can't miss it
+    atomic<long> queued;
+    mutex sleepLock;
+    condition_variable wake;
+    // Pool and index of the worker running on this thread, NULL and -1 for other threads
+    static thread_local WorkStealingPool *owner;
+    static thread_local int self;
+
+    // Index of the calling worker in this pool, a worker of another pool counts as outside
+    int Self()
+    { return (owner == this) ? self : -1; }
+    void Work(int index)
+    {
+        owner = this;
+        self = index;
+        while (true)
+        {
+            if (RunOne()) { continue; }
+            unique_lock<mutex> lk(sleepLock);
+            wake.wait(lk, [this] { return stop || queued > 0; });
+            if (stop) { break; }
+        }
+    }
+public:
+    WorkStealingPool(unsigned n) : stop(false), next(0), queued(0)
+    {
+        if (n == 0) { n = 1; }
+        for (unsigned i = 0; i < n; i++)
+        { queues.push_back(new Queue()); }
+        for (unsigned i = 0; i < n; i++)
+        { workers.push_back(thread(&WorkStealingPool::Work, this, (int)i)); }
+    }
+    ~WorkStealingPool()
+    {
+        {
+            lock_guard<mutex> lk(sleepLock);
+            stop = true;
+        }
+        wake.notify_all();
+        for (size_t i = 0; i < workers.size(); i++)
+        { workers[i].join(); }
+        for (size_t i = 0; i < queues.size(); i++)
+        { delete queues[i]; }
+    }
+    unsigned Size()
+    { return workers.size(); }
+    // Push to the queue of the calling worker, or spread over the queues from outside
+    void Submit(function<void()> task)
+    {
+        int me = Self();
+        int i = (me >= 0) ? me : (int)(next++ % queues.size());
+        {
+            lock_guard<mutex> lk(queues[i]->lock);
+            queues[i]->tasks.push_back(task);
+        }
+        {
+            lock_guard<mutex> lk(sleepLock);
+            queued++;
+        }
+        wake.notify_one();
+    }
+    // Run one pending task if there is any, waiting threads call it to help out
+    bool RunOne()
+    {
+        int n = queues.size();
+        int me = Self();
+        int start = (me >= 0) ? me : (int)(next % n);
+        for (int k = 0; k < n; k++)
+        {
+            Queue *q = queues[(start + k) % n];
+            function<void()> task;
+            {
+                lock_guard<mutex> lk(q->lock);
+                if (q->tasks.empty()) { continue; }
+                if (k == 0 && me >= 0) { task = q->tasks.back(); q->tasks.pop_back(); }
+                else { task = q->tasks.front(); q->tasks.pop_front(); }
+            }
+            queued--;
+            task();
+            return true;
+        }
+        return false;
+    }
+};
+// Initialize static members
+thread_local WorkStealingPool *WorkStealingPool::owner = NULL;
+thread_local int WorkStealingPool::self = -1;
+
+// A set of tasks to wait for, the waiting thread keeps running tasks meanwhile
+class TaskGroup
+{
+private:
+    WorkStealingPool *pool;
+    atomic<int> pending;
+public:
+    TaskGroup(WorkStealingPool *p) : pool(p), pending(0) { }
+    void Spawn(function<void()> task)
+    {
+        pending++;
+        pool->Submit([this, task]() { task(); pending--; });
+    }
+    void Wait()
+    {
+        while (pending > 0)
+        { if (!pool->RunOne()) { this_thread::yield(); } }
+    }
+};
+
 // Abstract class of all components
 class AbstractComponent_Graphics
 {
+friend class Picture;
 protected:
     string desc;
+    // The picture this component belongs to, a component belongs to one picture only
+    Picture *parent;
+    // Tell the parent pictures their drawing is out of date
+    void Changed();
 public:
-    AbstractComponent_Graphics(string s) { desc = s; }
+    AbstractComponent_Graphics(string s) : parent(NULL) { desc = s; }
+    virtual ~AbstractComponent_Graphics() { }
     // component interface
-    virtual void Draw() = 0;
+    virtual void Render(string &out) = 0;
+    virtual void Draw()
+    {
+        string out;
+        Render(out);
+        cout << out << flush;
+    }
+    // Number of components in this sub tree
+    virtual size_t Nodes() { return 1; }
+    void SetDesc(string s)
+    {
+        desc = s;
+        Changed();
+    }
 };
 
-// For convenience of for_each
-void drawChildren(AbstractComponent_Graphics *g) { g->Draw(); }
+// Handle of a child inside a picture, returned by Picture::Add
+// The generation tells whether the handle still refers to a live child
+struct ComponentHandle
+{
+    unsigned slot;
+    unsigned generation;
+};
 
 // The main component which will assamble other components together
 // It doesn't have to inherit the abstract component class, but if you can, do it
-class Picture : AbstractComponent_Graphics
+// A picture keeps its last drawing, only sub trees changed since then are drawn again
+class Picture : public AbstractComponent_Graphics
 {
 private:
-    // The list of compoents
+    // Position of a child in picList, looked up by handle slot
+    struct Slot
+    {
+        unsigned pos;
+        unsigned generation;
+    };
+    // The list of compoents, NULL marks a removed one in ordered mode
     vector<AbstractComponent_Graphics*> picList;
+    // Slot owning each item of picList, to fix up handles when items move
+    vector<unsigned> picSlots;
+    vector<Slot> slots;
+    vector<unsigned> freeSlots;
+    // Keep drawing order on remove, otherwise swap the last item into the hole
+    bool keepOrder;
+    size_t tombstones;
+    // Last drawing of the whole sub tree, and whether it is out of date
+    string cache;
+    bool dirty;
+    size_t nodes;
+
+    // Squeeze out removed items, only used in ordered mode
+    void Compact()
+    {
+        size_t n = 0;
+        for (size_t i = 0; i < picList.size(); i++)
+        {
+            if (picList[i] == NULL) { continue; }
+            picList[n] = picList[i];
+            picSlots[n] = picSlots[i];
+            slots[picSlots[n]].pos = n;
+            n++;
+        }
+        picList.resize(n);
+        picSlots.resize(n);
+        tombstones = 0;
+    }
+    // Add the node count change to this picture and all its parents
+    void Resize(long delta)
+    {
+        for (Picture *p = this; p; p = p->parent)
+        { p->nodes += delta; }
+    }
 public:
-    Picture(string desc) : AbstractComponent_Graphics(desc) { }
+    // Sub pictures with at least this many nodes are drawn as separated tasks
+    static const size_t ParallelGrain = 4096;
+
+    Picture(string desc, bool ordered = false)
+        : AbstractComponent_Graphics(desc), keepOrder(ordered), tombstones(0), dirty(true), nodes(1) { }
+    ~Picture()
+    {
+        for (size_t i = 0; i < picList.size(); i++)
+        { if (picList[i]) { picList[i]->parent = NULL; } }
+    }
+    // Mark this picture and its parents out of date
+    // Stop at the first dirty one, all pictures above it are dirty already
+    void MarkDirty()
+    {
+        for (Picture *p = this; p && !p->dirty; p = p->parent)
+        { p->dirty = true; }
+    }
+    // Force the whole sub tree to be drawn again
+    void Invalidate()
+    {
+        dirty = true;
+        for (size_t i = 0; i < picList.size(); i++)
+        {
+            Picture *p = dynamic_cast<Picture*>(picList[i]);
+            if (p) { p->Invalidate(); }
+        }
+    }
+    // Draw the changed sub trees again, big sub pictures are drawn on the pool if given
+    // Each sub picture draws into its own cache, so the output order is always the same
+    void Update(WorkStealingPool *pool)
+    {
+        if (!dirty) { return; }
+        if (pool)
+        {
+            TaskGroup group(pool);
+            for (size_t i = 0; i < picList.size(); i++)
+            {
+                Picture *p = dynamic_cast<Picture*>(picList[i]);
+                if (p && p->dirty && p->nodes >= ParallelGrain)
+                { group.Spawn([p, pool]() { p->Update(pool); }); }
+            }
+            group.Wait();
+        }
+        cache.clear();
+        cache += "== Begin draw picture: " + desc + " ==\n";
+        for (size_t i = 0; i < picList.size(); i++)
+        { if (picList[i]) { picList[i]->Render(cache); } }
+        cache += "=======================\n";
+        dirty = false;
+    }
     // Implement interface
-    void Draw()
+    void Render(string &out)
     {
-        cout << "== Begin draw picture: " << desc << " =="<< endl;
-        for_each (picList.begin(), picList.end(), drawChildren);
-        cout << "=======================" << endl;
+        Update(NULL);
+        out += cache;
     }
+    // Draw with sub pictures spread over the pool
+    using AbstractComponent_Graphics::Draw;
+    void Draw(WorkStealingPool *pool)
+    {
+        Update(pool);
+        cout << cache << flush;
+    }
+    size_t Nodes()
+    { return nodes; }
+    // Number of components in the picture
+    size_t Count()
+    { return picList.size() - tombstones; }
     // Add component to the final product
-    void Add(AbstractComponent_Graphics *g) 
-    { picList.push_back(g); }
-    // Remove component, be careful about how STL remove an item from list
-    void Remove(AbstractComponent_Graphics *g)
-    { picList.erase(remove(picList.begin(), picList.end(), g)); }
+    ComponentHandle Add(AbstractComponent_Graphics *g)
+    {
+        unsigned slot;
+        if (freeSlots.empty())
+        {
+            slot = slots.size();
+            Slot s = { 0, 0 };
+            slots.push_back(s);
+        }
+        else
+        {
+            slot = freeSlots.back();
+            freeSlots.pop_back();
+        }
+        slots[slot].pos = picList.size();
+        picList.push_back(g);
+        picSlots.push_back(slot);
+        g->parent = this;
+        Resize(g->Nodes());
+        MarkDirty();
+        ComponentHandle h = { slot, slots[slot].generation };
+        return h;
+    }
+    // Remove component in O(1), return false if the handle is stale
+    bool Remove(ComponentHandle h)
+    {
+        if (h.slot >= slots.size() || slots[h.slot].generation != h.generation)
+        { return false; }
+        unsigned pos = slots[h.slot].pos;
+        AbstractComponent_Graphics *g = picList[pos];
+        slots[h.slot].generation++;
+        freeSlots.push_back(h.slot);
+        if (keepOrder)
+        {
+            // Leave a tombstone, compact once they take up half of the list
+            picList[pos] = NULL;
+            tombstones++;
+            if (tombstones > 64 && tombstones * 2 > picList.size())
+            { Compact(); }
+        }
+        else
+        {
+            picList[pos] = picList.back();
+            picSlots[pos] = picSlots.back();
+            slots[picSlots[pos]].pos = pos;
+            picList.pop_back();
+            picSlots.pop_back();
+        }
+        g->parent = NULL;
+        Resize(-(long)g->Nodes());
+        MarkDirty();
+        return true;
+    }
+    // Remove component without handle, it has to search the list first
+    bool Remove(AbstractComponent_Graphics *g)
+    {
+        if (g == NULL) { return false; }
+        vector<AbstractComponent_Graphics*>::iterator i = find(picList.begin(), picList.end(), g);
+        if (i == picList.end()) { return false; }
+        unsigned slot = picSlots[i - picList.begin()];
+        ComponentHandle h = { slot, slots[slot].generation };
+        return Remove(h);
+    }
 };
 
+// To avoid "incomplete type" error, put define to outside
+void AbstractComponent_Graphics::Changed()
+{ if (parent) { parent->MarkDirty(); } }
+
 // A concrete component
 class Line : public AbstractComponent_Graphics
 {
 public:
     Line(string desc) : AbstractComponent_Graphics(desc) { }
     // Implement interface
-    void Draw()
-    { cout << "Draw a line [" + desc << "]" << endl; }
+    void Render(string &out)
+    { out += "Draw a line [" + desc + "]\n"; }
 };
 
 // Another concrete component
@@ -65,8 +387,8 @@ class Circle: public AbstractComponent_Graphics
 public:
     Circle(string desc) : AbstractComponent_Graphics(desc) { }
     // Implement interface
-    void Draw()
-    { cout << "Draw a circle [" + desc << "]" << endl; }
+    void Render(string &out)
+    { out += "Draw a circle [" + desc + "]\n"; }
 };
 
 // Another concrete component
@@ -75,24 +397,183 @@ class Rectangle: public AbstractComponent_Graphics
 public:
     Rectangle(string desc) : AbstractComponent_Graphics(desc) { }
     // Implement interface
-    void Draw()
-    { cout << "Draw a rectangle [" + desc << "]" << endl; }
+    void Render(string &out)
+    { out += "Draw a rectangle [" + desc + "]\n"; }
+};
+
+// Swallow everything written to it, so benchmarks don't measure the terminal
+class NullBuffer : public streambuf
+{
+protected:
+    int overflow(int c) { return c; }
 };
 
+// Churn benchmark: random add/remove on a large picture with a draw now and then
+// The old linear erase is run with fewer operations since it is O(n) per remove
+void BenchChurn(size_t children, size_t ops)
+{
+    cout << "Churn benchmark: " << children << " children, " << ops << " operations" << endl;
+    vector<AbstractComponent_Graphics*> pool;
+    for (size_t i = 0; i < children * 2; i++)
+    { pool.push_back(new Line("bench")); }
+
+    NullBuffer nullBuffer;
+    const char *modes[] = { "linear erase", "swap and pop", "ordered tombstones" };
+    for (int mode = 0; mode < 3; mode++)
+    {
+        size_t rounds = (mode == 0) ? min(ops, (size_t)20000) : ops;
+        mt19937 rng(42);
+        Picture pic("bench", mode == 2);
+        vector<AbstractComponent_Graphics*> plain;
+        vector<pair<AbstractComponent_Graphics*, ComponentHandle> > live;
+        vector<AbstractComponent_Graphics*> idle(pool.begin() + children, pool.end());
+        for (size_t i = 0; i < children; i++)
+        {
+            ComponentHandle h = { 0, 0 };
+            if (mode == 0) { plain.push_back(pool[i]); }
+            else { h = pic.Add(pool[i]); }
+            live.push_back(make_pair(pool[i], h));
+        }
+
+        streambuf *old = cout.rdbuf(&nullBuffer);
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        for (size_t op = 0; op < rounds; op++)
+        {
+            unsigned r = rng() % 100000;
+            if (r == 0)
+            {
+                // Draw
+                if (mode == 0)
+                {
+                    for (size_t i = 0; i < plain.size(); i++)
+                    { plain[i]->Draw(); }
+                }
+                else { pic.Draw(); }
+            }
+            else if ((r & 1) && !idle.empty())
+            {
+                // Add
+                AbstractComponent_Graphics *g = idle.back();
+                idle.pop_back();
+                ComponentHandle h = { 0, 0 };
+                if (mode == 0) { plain.push_back(g); }
+                else { h = pic.Add(g); }
+                live.push_back(make_pair(g, h));
+            }
+            else if (!live.empty())
+            {
+                // Remove a random child
+                size_t k = rng() % live.size();
+                if (mode == 0)
+                { plain.erase(remove(plain.begin(), plain.end(), live[k].first), plain.end()); }
+                else { pic.Remove(live[k].second); }
+                idle.push_back(live[k].first);
+                live[k] = live.back();
+                live.pop_back();
+            }
+        }
+        double sec = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout.rdbuf(old);
+        cout << "  " << modes[mode] << ": " << rounds << " ops in " << sec << " s, "
+             << (size_t)(rounds / sec) << " ops/s" << endl;
+    }
+
+    for (size_t i = 0; i < pool.size(); i++)
+    { delete pool[i]; }
+}
+
+// Build a balanced scene, every picture has "fanout" children, leaves are at "depth"
+// "nodes" gets every node, a picture before its children, which is also the order to delete them in
+Picture* BuildScene(int depth, int fanout, vector<AbstractComponent_Graphics*> &leaves,
+                    vector<AbstractComponent_Graphics*> &nodes)
+{
+    Picture *pic = new Picture("level " + to_string(depth));
+    nodes.push_back(pic);
+    for (int i = 0; i < fanout; i++)
+    {
+        if (depth > 1)
+        { pic->Add(BuildScene(depth - 1, fanout, leaves, nodes)); }
+        else
+        {
+            Line *l = new Line("leaf " + to_string(leaves.size()));
+            leaves.push_back(l);
+            nodes.push_back(l);
+            pic->Add(l);
+        }
+    }
+    return pic;
+}
+
+// Redraw benchmark: change 1% of the leaves per frame, then draw the whole scene
+// Full redraw throws away all cached drawings, incremental only redraws dirty sub trees
+void BenchRedraw(int depth, int fanout, int frames, unsigned threads)
+{
+    vector<AbstractComponent_Graphics*> leaves, nodes;
+    Picture *root = BuildScene(depth, fanout, leaves, nodes);
+    cout << "Redraw benchmark: " << root->Nodes() << " nodes, " << leaves.size() << " leaves, "
+         << frames << " frames, " << threads << " threads" << endl;
+    WorkStealingPool pool(threads);
+    string reference;
+    const char *modes[] = { "full", "incremental", "incremental parallel" };
+    for (int mode = 0; mode < 3; mode++)
+    {
+        mt19937 rng(7);
+        double sec = 0;
+        string frame;
+        for (int f = 0; f < frames; f++)
+        {
+            for (size_t i = 0; i < leaves.size() / 100; i++)
+            { leaves[rng() % leaves.size()]->SetDesc("leaf changed in frame " + to_string(f)); }
+            chrono::steady_clock::time_point start = chrono::steady_clock::now();
+            if (mode == 0) { root->Invalidate(); }
+            root->Update(mode == 2 ? &pool : NULL);
+            frame.clear();
+            root->Render(frame);
+            sec += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        }
+        // Every mode applies the same changes, so the last frame must be the same
+        if (mode == 0) { reference = frame; }
+        cout << "  " << modes[mode] << ": " << (sec / frames * 1000) << " ms/frame, "
+             << frame.size() << " bytes" << (frame == reference ? "" : " (OUTPUT MISMATCH)") << endl;
+    }
+    // A picture only lets go of its children, so the whole scene is deleted node by node
+    for (size_t i = 0; i < nodes.size(); i++)
+    { delete nodes[i]; }
+}
+
 // Test Composite pattern
-int main()
+// Run "main bench [churn|redraw]" for the benchmarks
+int main(int argc, char *argv[])
 {
-    Picture *root = new Picture("map");
+    if (argc > 1 && string(argv[1]) == "bench")
+    {
+        string which = (argc > 2) ? argv[2] : "";
+        if (which == "" || which == "churn")
+        { BenchChurn(200000, 2000000); }
+        if (which == "" || which == "redraw")
+        { BenchRedraw(5, 16, 5, thread::hardware_concurrency()); }
+        return 0;
+    }
+
+    // Ordered picture, removing a line keeps the drawing order of the others
+    Picture *root = new Picture("map", true);
 
     root->Add(new Line("at the bottom"));
     root->Add(new Rectangle("above the line"));
-    Line *l = new Line("this line will be remove");
-    root->Add(l);
+    ComponentHandle l = root->Add(new Line("this line will be remove"));
     root->Add(new Circle("in the rectangle"));
     root->Add(new Line("on the left side of rectangle"));
     root->Remove(l);
     root->Draw();
 
+    // Pictures can be nested, only the changed sub picture is drawn again
+    Picture *legend = new Picture("legend");
+    Circle *mark = new Circle("a mark");
+    legend->Add(mark);
+    root->Add(legend);
+    mark->SetDesc("a moved mark");
+    root->Draw();
+
     // The end
     return 0;
 }
@@ -11,6 +11,20 @@
  */
 
 #include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <random>
+#include <chrono>
+#include <thread>
+#include <future>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <unordered_map>
+#include <cmath>
+#include <climits>
 using namespace std;
 
 // The user class
@@ -22,31 +36,213 @@ public:
     string GetName() { return name; }
 }; 
 
+// Simulated remote lookup shared by the sub systems, for testing without real backends
+class Backend
+{
+protected:
+    // Simulated latency, a lookup takes latency +/- jitter
+    int latencyUs, jitterUs;
+    // Share of customers rejected by this backend, decided by customer name
+    double rejectRate;
+    string tag;
+
+    // Wait like a slow lookup would, return false if cancelled meanwhile
+    // The wait is cut in slices, so a cancelled lookup gives up early
+    bool Wait(const atomic<bool> *cancel)
+    {
+        static thread_local mt19937 rng(random_device{}());
+        if (latencyUs > 0)
+        {
+            int us = latencyUs + (jitterUs > 0 ? (int)(rng() % (2 * jitterUs + 1)) - jitterUs : 0);
+            chrono::steady_clock::time_point end = chrono::steady_clock::now() + chrono::microseconds(us);
+            while (chrono::steady_clock::now() < end)
+            {
+                if (cancel && *cancel) { return false; }
+                this_thread::sleep_for(min(chrono::microseconds(100),
+                    chrono::duration_cast<chrono::microseconds>(end - chrono::steady_clock::now())));
+            }
+        }
+        return !(cancel && *cancel);
+    }
+    // The answer of the backend for one customer
+    bool Accepts(Customer *c)
+    { return (hash<string>()(c->GetName() + tag) % 10000) >= rejectRate * 10000; }
+    // Answer one customer
+    bool Lookup(Customer *c, const atomic<bool> *cancel)
+    { return Wait(cancel) && Accepts(c); }
+    // Answer a batch in one round trip, clear the bit of each customer in "which" that is rejected
+    void LookupBatch(Customer *custs, const vector<size_t> &which, vector<bool> &ok)
+    {
+        Wait(NULL);
+        for (size_t i = 0; i < which.size(); i++)
+        { if (!Accepts(&custs[which[i]])) { ok[which[i]] = false; } }
+    }
+public:
+    // Print each check, turn it off for benchmarks
+    bool verbose;
+    Backend(string t) : latencyUs(0), jitterUs(0), rejectRate(0), tag(t), verbose(true) { }
+    void Simulate(int latency, int jitter, double reject)
+    { latencyUs = latency; jitterUs = jitter; rejectRate = reject; }
+    // One write per line, so checks running at the same time don't mix their output
+    void Log(string s)
+    { if (verbose) { cout << s + "\n" << flush; } }
+};
+
 // Bank sub-system
-class Bank
+class Bank : public Backend
 {
 public:
+    // Savings never cover loans above this, no limit by default
+    int maxAmount;
+    Bank() : Backend("bank"), maxAmount(INT_MAX) { }
     // A mutable interface
-    bool HasSufficientSavings(Customer *c, int amount)
-    { cout << "Check bank for " << c->GetName() << " have more than " << amount << endl; return true; }
+    bool HasSufficientSavings(Customer *c, int amount, const atomic<bool> *cancel = NULL)
+    {
+        Log("Check bank for " + c->GetName() + " have more than " + to_string(amount));
+        return Lookup(c, cancel) && amount <= maxAmount;
+    }
+    // Batch interface, only customers listed in "which" are checked, each for its own amount
+    void HasSufficientSavings(Customer *custs, const int *amounts, const vector<size_t> &which, vector<bool> &ok)
+    {
+        Log("Check bank for " + to_string(which.size()) + " customers");
+        LookupBatch(custs, which, ok);
+        for (size_t i = 0; i < which.size(); i++)
+        { if (amounts[which[i]] > maxAmount) { ok[which[i]] = false; } }
+    }
 };
 
 // Credit sub-system
-class Credit
+class Credit : public Backend
 {
 public:
+    Credit() : Backend("credit") { }
     // A mutable interface
-    bool HasGoodCredit(Customer *c)
-    { cout << "Check credit for " << c->GetName() << endl; return true; }
+    bool HasGoodCredit(Customer *c, const atomic<bool> *cancel = NULL)
+    { Log("Check credit for " + c->GetName()); return Lookup(c, cancel); }
+    // Batch interface, only customers listed in "which" are checked
+    void HasGoodCredit(Customer *custs, const vector<size_t> &which, vector<bool> &ok)
+    { Log("Check credit for " + to_string(which.size()) + " customers"); LookupBatch(custs, which, ok); }
 };
 
 // Loan sub-system
-class Loan
+class Loan : public Backend
 {
 public:
+    Loan() : Backend("loan") { }
     // A mutable interface
-    bool HasNoBadLoans(Customer *c)
-    { cout << "Check loans for " << c->GetName() << endl; return true; }
+    bool HasNoBadLoans(Customer *c, const atomic<bool> *cancel = NULL)
+    { Log("Check loans for " + c->GetName()); return Lookup(c, cancel); }
+    // Batch interface, only customers listed in "which" are checked
+    void HasNoBadLoans(Customer *custs, const vector<size_t> &which, vector<bool> &ok)
+    { Log("Check loans for " + to_string(which.size()) + " customers"); LookupBatch(custs, which, ok); }
+};
+
+// Answers of the sub systems remembered for a while
+// Split into shards with their own lock, each shard evicts with the CLOCK algorithm
+class ResultCache
+{
+private:
+    struct Entry
+    {
+        string key;
+        bool value;
+        bool referenced;
+        chrono::steady_clock::time_point expiry;
+    };
+    struct Shard
+    {
+        mutex lock;
+        unordered_map<string, size_t> index;
+        vector<Entry> entries;
+        size_t hand;
+        Shard() : hand(0) { }
+    };
+    vector<Shard*> shards;
+    size_t shardCapacity;
+    chrono::milliseconds ttl;
+    atomic<size_t> hits, misses, evictions;
+
+    Shard* ShardOf(const string &key)
+    { return shards[hash<string>()(key) % shards.size()]; }
+public:
+    // Keep at most "capacity" answers, each for "ttlMs" milliseconds
+    ResultCache(size_t capacity, int ttlMs, int shardCount = 16)
+        : ttl(ttlMs), hits(0), misses(0), evictions(0)
+    {
+        for (int i = 0; i < shardCount; i++)
+        { shards.push_back(new Shard()); }
+        shardCapacity = max((size_t)1, capacity / shardCount);
+    }
+    ~ResultCache()
+    { for (size_t i = 0; i < shards.size(); i++) { delete shards[i]; } }
+
+    // Give the remembered answer if there is one still fresh
+    bool Get(const string &key, bool &value)
+    {
+        Shard *s = ShardOf(key);
+        {
+            lock_guard<mutex> lk(s->lock);
+            unordered_map<string, size_t>::iterator i = s->index.find(key);
+            if (i != s->index.end() && s->entries[i->second].expiry > chrono::steady_clock::now())
+            {
+                Entry &e = s->entries[i->second];
+                e.referenced = true;
+                value = e.value;
+                hits++;
+                return true;
+            }
+        }
+        misses++;
+        return false;
+    }
+    // Remember an answer, a full shard evicts the first entry not used since the hand passed it
+    void Put(const string &key, bool value)
+    {
+        Shard *s = ShardOf(key);
+        chrono::steady_clock::time_point expiry = chrono::steady_clock::now() + ttl;
+        lock_guard<mutex> lk(s->lock);
+        unordered_map<string, size_t>::iterator i = s->index.find(key);
+        size_t slot;
+        if (i != s->index.end())
+        { slot = i->second; }
+        else if (s->entries.size() < shardCapacity)
+        {
+            slot = s->entries.size();
+            s->entries.push_back(Entry());
+            s->index[key] = slot;
+        }
+        else
+        {
+            while (s->entries[s->hand].referenced)
+            {
+                s->entries[s->hand].referenced = false;
+                s->hand = (s->hand + 1) % s->entries.size();
+            }
+            slot = s->hand;
+            s->hand = (s->hand + 1) % s->entries.size();
+            s->index.erase(s->entries[slot].key);
+            s->index[key] = slot;
+            evictions++;
+        }
+        Entry &e = s->entries[slot];
+        e.key = key;
+        e.value = value;
+        e.referenced = false;
+        e.expiry = expiry;
+    }
+    size_t Entries()
+    {
+        size_t n = 0;
+        for (size_t i = 0; i < shards.size(); i++)
+        {
+            lock_guard<mutex> lk(shards[i]->lock);
+            n += shards[i]->entries.size();
+        }
+        return n;
+    }
+    size_t Hits() { return hits; }
+    size_t Misses() { return misses; }
+    size_t Evictions() { return evictions; }
 };
 
 // The facade class, hide sub-systems behind it
@@ -57,27 +253,337 @@ private:
     Bank *bank;
     Loan *loan;
     Credit *credit;
+
+    // Answers of the concurrent checks, the first rejection decides
+    struct Decision
+    {
+        mutex lock;
+        condition_variable done;
+        int answered;
+        bool rejected;
+        atomic<bool> cancel;
+        Decision() : answered(0), rejected(false), cancel(false) { }
+        void Answer(bool ok)
+        {
+            lock_guard<mutex> lk(lock);
+            answered++;
+            if (!ok) { rejected = true; cancel = true; }
+            done.notify_one();
+        }
+    };
+    // Observed rejections of each sub system, the batch asks the strictest one first
+    atomic<size_t> asked[3], rejected[3];
+    // Remembered answers of the sub systems, NULL if caching is off
+    ResultCache *cache;
+    int amountBucket;
+
+    // Ask the cache first, and remember what the sub system answers
+    // A cancelled check is not remembered, it didn't get a real answer
+    template <class Check>
+    bool Cached(const string &key, const atomic<bool> *cancel, Check check)
+    {
+        bool ok;
+        if (cache && cache->Get(key, ok)) { return ok; }
+        ok = check();
+        if (cache && !(cancel && *cancel)) { cache->Put(key, ok); }
+        return ok;
+    }
+    // Cache key of the answer of sub system "k", 0 bank, 1 loan, 2 credit
+    // The bank answer is remembered per amount bucket
+    string CacheKey(int k, Customer *cust, int amount)
+    {
+        if (k == 0) { return "bank:" + cust->GetName() + ":" + to_string(amount / amountBucket); }
+        return (k == 1 ? "loan:" : "credit:") + cust->GetName();
+    }
+    bool CheckBank(Customer *cust, int amount, const atomic<bool> *cancel)
+    { return Cached(CacheKey(0, cust, amount), cancel, [&]() { return bank->HasSufficientSavings(cust, amount, cancel); }); }
+    bool CheckLoan(Customer *cust, const atomic<bool> *cancel)
+    { return Cached(CacheKey(1, cust, 0), cancel, [&]() { return loan->HasNoBadLoans(cust, cancel); }); }
+    bool CheckCredit(Customer *cust, const atomic<bool> *cancel)
+    { return Cached(CacheKey(2, cust, 0), cancel, [&]() { return credit->HasGoodCredit(cust, cancel); }); }
 public:
+    // Reorder the batch checks by observed rejection rate, otherwise bank, loan, credit
+    bool reorderChecks;
+
+    Mortgage() : bank(new Bank()), loan(new Loan()), credit(new Credit()), cache(NULL), amountBucket(1), reorderChecks(true)
+    { for (int i = 0; i < 3; i++) { asked[i] = 0; rejected[i] = 0; } }
+    ~Mortgage() { delete bank; delete loan; delete credit; delete cache; }
+    // Remember up to "capacity" answers for "ttlMs" milliseconds
+    // Bank answers are shared by the amounts in the same bucket of "bucket" size
+    // Single and batch checks both read and fill it
+    void EnableCache(size_t capacity, int ttlMs, int bucket)
+    {
+        delete cache;
+        cache = new ResultCache(capacity, ttlMs);
+        amountBucket = max(1, bucket);
+    }
+    ResultCache* GetCache() { return cache; }
+    Bank* GetBank() { return bank; }
+    Loan* GetLoan() { return loan; }
+    Credit* GetCredit() { return credit; }
+
     // Simply the three interfaces to only one
     bool IsEligible(Customer *cust, int amount)
     {
         cout << cust->GetName() << " applies for " << amount << " loan" << endl;
         bool eligible = true; 
         // Use interface provided by sub systems
-        if (!bank->HasSufficientSavings(cust, amount))
+        if (!CheckBank(cust, amount, NULL))
         { eligible = false; }
-        else if (!loan->HasNoBadLoans(cust))
+        else if (!CheckLoan(cust, NULL))
         { eligible = false; }
-        else if (!credit->HasGoodCredit(cust))
+        else if (!CheckCredit(cust, NULL))
         { eligible = false; }
 
         return eligible;
     }
+
+    // Same as IsEligible, but ask the three sub systems at the same time
+    // The first rejection cancels the checks still running
+    bool IsEligibleConcurrent(Customer *cust, int amount)
+    {
+        cout << cust->GetName() << " applies for " << amount << " loan" << endl;
+        Decision d;
+        future<void> checks[] = {
+            async(launch::async, [&]() { d.Answer(CheckBank(cust, amount, &d.cancel)); }),
+            async(launch::async, [&]() { d.Answer(CheckLoan(cust, &d.cancel)); }),
+            async(launch::async, [&]() { d.Answer(CheckCredit(cust, &d.cancel)); })
+        };
+        bool eligible;
+        {
+            unique_lock<mutex> lk(d.lock);
+            d.done.wait(lk, [&]() { return d.rejected || d.answered == 3; });
+            eligible = !d.rejected;
+        }
+        // The cancelled checks return within one slice, the futures wait for them
+        for (int i = 0; i < 3; i++)
+        { checks[i].wait(); }
+        return eligible;
+    }
+
+    // Check a whole batch, amounts[i] is the loan of custs[i], bit i of the result tells the answer
+    // Each sub system gets only the customers which have passed the checks before it,
+    // and with the cache on only those it has no remembered answer for
+    // The rejection counters are only a hint for the order, batches running at once may interleave them
+    vector<bool> IsEligibleBatch(Customer *custs, const int *amounts, size_t n)
+    {
+        vector<bool> ok(n, true);
+        vector<size_t> pending(n);
+        for (size_t i = 0; i < n; i++) { pending[i] = i; }
+
+        double rate[3];
+        int order[3] = { 0, 1, 2 };
+        for (int k = 0; k < 3; k++)
+        { rate[k] = (rejected[k].load(memory_order_relaxed) + 1.0) / (asked[k].load(memory_order_relaxed) + 2.0); }
+        if (reorderChecks)
+        { sort(order, order + 3, [&](int x, int y) { return rate[x] > rate[y]; }); }
+
+        for (int i = 0; i < 3 && !pending.empty(); i++)
+        {
+            int k = order[i];
+            vector<size_t> ask;
+            if (cache)
+            {
+                for (size_t j = 0; j < pending.size(); j++)
+                {
+                    size_t c = pending[j];
+                    bool known;
+                    if (cache->Get(CacheKey(k, &custs[c], amounts[c]), known)) { ok[c] = known; }
+                    else { ask.push_back(c); }
+                }
+            }
+            else { ask = pending; }
+            if (!ask.empty())
+            {
+                if (k == 0) { bank->HasSufficientSavings(custs, amounts, ask, ok); }
+                else if (k == 1) { loan->HasNoBadLoans(custs, ask, ok); }
+                else { credit->HasGoodCredit(custs, ask, ok); }
+            }
+            if (cache)
+            {
+                for (size_t j = 0; j < ask.size(); j++)
+                { cache->Put(CacheKey(k, &custs[ask[j]], amounts[ask[j]]), ok[ask[j]]); }
+            }
+            // Keep the customers still eligible for the next sub system
+            size_t kept = 0;
+            for (size_t j = 0; j < pending.size(); j++)
+            { if (ok[pending[j]]) { pending[kept++] = pending[j]; } }
+            asked[k].fetch_add(pending.size(), memory_order_relaxed);
+            rejected[k].fetch_add(pending.size() - kept, memory_order_relaxed);
+            pending.resize(kept);
+        }
+        return ok;
+    }
+};
+
+// Swallow everything written to it, so benchmarks don't measure the terminal
+class NullBuffer : public streambuf
+{
+protected:
+    int overflow(int c) { return c; }
 };
 
+// Decision latency of the sequential and the concurrent facade over simulated backends
+void BenchLatency(int applications)
+{
+    Mortgage mortgage;
+    mortgage.GetBank()->Simulate(1000, 500, 0.05);
+    mortgage.GetLoan()->Simulate(2000, 1000, 0.05);
+    mortgage.GetCredit()->Simulate(3000, 1500, 0.05);
+    mortgage.GetBank()->verbose = mortgage.GetLoan()->verbose = mortgage.GetCredit()->verbose = false;
+    cout << "Latency benchmark: " << applications << " applications, "
+         << "backends 1ms/2ms/3ms, 5% rejection each" << endl;
+
+    NullBuffer nullBuffer;
+    const char *modes[] = { "sequential", "concurrent" };
+    for (int mode = 0; mode < 2; mode++)
+    {
+        vector<double> ms;
+        int approved = 0;
+        streambuf *old = cout.rdbuf(&nullBuffer);
+        for (int i = 0; i < applications; i++)
+        {
+            Customer c("customer " + to_string(i));
+            chrono::steady_clock::time_point start = chrono::steady_clock::now();
+            bool ok = (mode == 0) ? mortgage.IsEligible(&c, 125000) : mortgage.IsEligibleConcurrent(&c, 125000);
+            ms.push_back(chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+            approved += ok;
+        }
+        cout.rdbuf(old);
+        sort(ms.begin(), ms.end());
+        cout << "  " << modes[mode] << ": p50 " << ms[ms.size() / 2] << " ms, p99 " << ms[ms.size() * 99 / 100]
+             << " ms, " << approved << " approved" << endl;
+    }
+}
+
+// Throughput of the batch facade, one backend round trip costs 200us per batch
+void BenchBatch()
+{
+    Mortgage mortgage;
+    mortgage.GetBank()->Simulate(200, 0, 0.02);
+    mortgage.GetLoan()->Simulate(200, 0, 0.05);
+    mortgage.GetCredit()->Simulate(200, 0, 0.20);
+    mortgage.GetBank()->verbose = mortgage.GetLoan()->verbose = mortgage.GetCredit()->verbose = false;
+    cout << "Batch benchmark: round trip 200us, rejection bank 2%, loan 5%, credit 20%" << endl;
+
+    vector<Customer> custs;
+    vector<int> amounts;
+    for (int i = 0; i < 65536; i++)
+    {
+        custs.push_back(Customer("customer " + to_string(i)));
+        amounts.push_back(100000 + i);
+    }
+    for (int reorder = 0; reorder < 2; reorder++)
+    {
+        mortgage.reorderChecks = reorder;
+        cout << (reorder ? "  reordered checks" : "  fixed order checks") << endl;
+        for (size_t batch = 1; batch <= custs.size(); batch *= 4)
+        {
+            // Run batches for at least 0.2 seconds
+            size_t done = 0, approved = 0;
+            double sec = 0;
+            while (sec < 0.2)
+            {
+                size_t from = done % custs.size();
+                if (from + batch > custs.size()) { from = 0; }
+                chrono::steady_clock::time_point start = chrono::steady_clock::now();
+                vector<bool> ok = mortgage.IsEligibleBatch(&custs[from], &amounts[from], batch);
+                sec += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+                approved += count(ok.begin(), ok.end(), true);
+                done += batch;
+            }
+            cout << "    batch " << batch << ": " << (size_t)(done / sec) << " applications/s, "
+                 << (100.0 * approved / done) << "% approved" << endl;
+        }
+    }
+}
+
+// Skewed workload: customer k is picked with probability proportional to 1 / k^s
+class Zipf
+{
+private:
+    vector<double> cdf;
+public:
+    Zipf(size_t n, double s)
+    {
+        double sum = 0;
+        for (size_t k = 1; k <= n; k++)
+        { sum += 1.0 / pow((double)k, s); cdf.push_back(sum); }
+        for (size_t k = 0; k < n; k++) { cdf[k] /= sum; }
+    }
+    size_t Next(mt19937 &rng)
+    {
+        double u = uniform_real_distribution<double>(0, 1)(rng);
+        return lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin();
+    }
+};
+
+// Cached facade under a Zipfian customer workload from several threads
+void BenchCache(int threads, int requests)
+{
+    const size_t customers = 100000;
+    vector<Customer> custs;
+    for (size_t i = 0; i < customers; i++)
+    { custs.push_back(Customer("customer " + to_string(i))); }
+    Zipf zipf(customers, 0.99);
+    cout << "Cache benchmark: " << customers << " customers, Zipf 0.99, " << threads << " threads x "
+         << requests << " requests, backends 50us, cache 10000 answers, TTL 10s" << endl;
+
+    for (int cached = 0; cached < 2; cached++)
+    {
+        Mortgage mortgage;
+        mortgage.GetBank()->Simulate(50, 0, 0.05);
+        mortgage.GetLoan()->Simulate(50, 0, 0.05);
+        mortgage.GetCredit()->Simulate(50, 0, 0.05);
+        mortgage.GetBank()->verbose = mortgage.GetLoan()->verbose = mortgage.GetCredit()->verbose = false;
+        if (cached) { mortgage.EnableCache(10000, 10000, 50000); }
+
+        NullBuffer nullBuffer;
+        streambuf *old = cout.rdbuf(&nullBuffer);
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        vector<thread> workers;
+        for (int t = 0; t < threads; t++)
+        {
+            workers.push_back(thread([&, t]() {
+                mt19937 rng(t);
+                for (int i = 0; i < requests; i++)
+                {
+                    size_t k = zipf.Next(rng);
+                    mortgage.IsEligible(&custs[k], 100000 + (rng() % 100000));
+                }
+            }));
+        }
+        for (int t = 0; t < threads; t++) { workers[t].join(); }
+        double sec = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout.rdbuf(old);
+
+        cout << "  " << (cached ? "cached" : "no cache") << ": " << (size_t)(threads * requests / sec) << " decisions/s";
+        ResultCache *c = mortgage.GetCache();
+        if (c)
+        {
+            cout << ", hit rate " << (100.0 * c->Hits() / (c->Hits() + c->Misses())) << "%, "
+                 << c->Entries() << " entries, " << c->Evictions() << " evictions";
+        }
+        cout << endl;
+    }
+}
+
 // Test Facade pattern
-int main()
+// Run "main bench [latency|batch|cache]" for the benchmarks
+int main(int argc, char *argv[])
 {
+    if (argc > 1 && string(argv[1]) == "bench")
+    {
+        string which = (argc > 2) ? argv[2] : "";
+        if (which == "" || which == "latency")
+        { BenchLatency(500); }
+        if (which == "" || which == "batch")
+        { BenchBatch(); }
+        if (which == "" || which == "cache")
+        { BenchCache(4, 5000); }
+        return 0;
+    }
+
     // Facade provide the simply interface
     Mortgage *mortgage = new Mortgage();
 
@@ -86,6 +592,23 @@ int main()
     bool eligable = mortgage->IsEligible(customer, 125000);
     cout << customer->GetName() << " has been " << (eligable ? "Approved" : "Rejected") << endl; 
 
+    // Ask the sub systems at the same time
+    eligable = mortgage->IsEligibleConcurrent(customer, 125000);
+    cout << customer->GetName() << " has been " << (eligable ? "Approved" : "Rejected") << endl; 
+
+    // Remember the answers, asking again only hits the cache
+    mortgage->EnableCache(1000, 60000, 10000);
+    mortgage->IsEligible(customer, 125000);
+    eligable = mortgage->IsEligible(customer, 125000);
+    cout << customer->GetName() << " has been " << (eligable ? "Approved" : "Rejected") << endl; 
+
+    // Check many customers at once
+    Customer batch[] = { Customer("Bob Smith"), Customer("Carol White"), Customer("Dan Brown") };
+    int amounts[] = { 50000, 80000, 200000 };
+    vector<bool> ok = mortgage->IsEligibleBatch(batch, amounts, 3);
+    for (int i = 0; i < 3; i++)
+    { cout << batch[i].GetName() << " has been " << (ok[i] ? "Approved" : "Rejected") << endl; }
+
     // The end
     return 0;
 }
@@ -21,16 +21,30 @@
 
 #include <iostream>
 #include <map>
+#include <fstream>
+#include <iterator>
+#include <cstdlib>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <atomic>
 using namespace std;
 
 // The abstract flyweight objects, interfaces
 class Charactor
 {
 public:
+    virtual ~Charactor() { }
     // Interfaces
     virtual void Display() = 0;
     // Shared attribute
     virtual char GetSymbol() = 0;
+    virtual unsigned GetCodePoint() = 0;
     virtual int GetWidth() = 0;
     virtual int GetHeight() = 0;
     virtual int GetAscent() = 0;
@@ -40,115 +54,644 @@ public:
     virtual void SetPointSize(int size) = 0;
 };
 
-// The static part of concrete flyweight object CharactorA
-class CharactorA_Shared
+// Open addressing hash table from (symbol, point size) to flyweight objects
+// Reads take no lock: a slot publishes its key after its value, and a table is never changed in place
+// when it grows, so a reader holding an old table still sees a valid one. Writers hold a lock.
+// Erase shifts the following entries back instead of leaving tombstones, a reader running at the
+// same time may then miss an entry, so a miss has to be checked again under the writers' lock.
+class GlyphTable
 {
-friend class CharactorA;
 private:
-    char _symbol;
-    int _width, _height, _ascent, _descent;
-    CharactorA_Shared()
-    { _symbol = 'A'; _height = 100; _width = 120; _ascent = 70; _descent = 0; }
-};
-// A concrete flyweight class
-class CharactorA : public Charactor
-{
-private:
-    // Stand alone attributes
-    int _pointSize;
-    // Shared attributes container
-    static CharactorA_Shared shared;
+    static const uint64_t Empty = ~(uint64_t)0;
+    struct Table
+    {
+        size_t mask;
+        atomic<uint64_t> *keys;
+        atomic<Charactor*> *values;
+        Table(size_t capacity) : mask(capacity - 1)
+        {
+            keys = new atomic<uint64_t>[capacity];
+            values = new atomic<Charactor*>[capacity];
+            for (size_t i = 0; i < capacity; i++)
+            { keys[i].store(Empty, memory_order_relaxed); values[i].store(NULL, memory_order_relaxed); }
+        }
+        ~Table() { delete[] keys; delete[] values; }
+    };
+    atomic<Table*> current;
+    // Tables replaced by a bigger one, readers may still use them so they live as long as this
+    vector<Table*> retired;
+    size_t count;
+    mutex writeLock;
+
+    static uint64_t Hash(uint64_t k)
+    {
+        k ^= k >> 33; k *= 0xff51afd7ed558ccdULL;
+        k ^= k >> 33; k *= 0xc4ceb9fe1a85ec53ULL;
+        return k ^ (k >> 33);
+    }
+    static void Put(Table *t, uint64_t key, Charactor *c)
+    {
+        size_t i = Hash(key) & t->mask;
+        while (t->keys[i].load(memory_order_relaxed) != Empty) { i = (i + 1) & t->mask; }
+        t->values[i].store(c, memory_order_relaxed);
+        t->keys[i].store(key, memory_order_release);
+    }
 public:
-    CharactorA(int size) : _pointSize(size) { }
-    // Implement the interfaces
-    virtual char GetSymbol() { return shared._symbol; }
-    virtual int GetWidth() { return shared._width; }
-    virtual int GetHeight() { return shared._height; }
-    virtual int GetAscent() { return shared._ascent; }
-    virtual int GetDescent() { return shared._descent; }
-    virtual int GetPointSize() { return _pointSize; }
-    virtual void SetPointSize(int size) { _pointSize = size; }
-    virtual void Display()
-    { cout << GetSymbol() << " pointsize: " << GetPointSize() << endl; }
+    static uint64_t Key(unsigned symbol, int size)
+    { return ((uint64_t)symbol << 32) | (uint32_t)size; }
+
+    GlyphTable() : current(new Table(64)), count(0) { }
+    ~GlyphTable()
+    {
+        delete current.load();
+        for (size_t i = 0; i < retired.size(); i++) { delete retired[i]; }
+    }
+    // Lock free lookup, NULL if not there, a hit is usually found at the first probe
+    Charactor* Find(uint64_t key)
+    {
+        Table *t = current.load(memory_order_acquire);
+        for (size_t i = Hash(key) & t->mask; ; i = (i + 1) & t->mask)
+        {
+            uint64_t k = t->keys[i].load(memory_order_acquire);
+            if (k == key) { return t->values[i].load(memory_order_relaxed); }
+            if (k == Empty) { return NULL; }
+        }
+    }
+    // Insert the object made by "create" unless another thread was faster, return the one in the table
+    template <class Create>
+    Charactor* Insert(uint64_t key, Create create)
+    {
+        lock_guard<mutex> lk(writeLock);
+        Charactor *c = Find(key);
+        if (c) { return c; }
+        c = create();
+        Table *t = current.load(memory_order_relaxed);
+        // Keep the table at most half full, so probes stay short
+        if ((count + 1) * 2 > t->mask + 1)
+        {
+            Table *bigger = new Table((t->mask + 1) * 2);
+            for (size_t i = 0; i <= t->mask; i++)
+            {
+                uint64_t k = t->keys[i].load(memory_order_relaxed);
+                if (k != Empty) { Put(bigger, k, t->values[i].load(memory_order_relaxed)); }
+            }
+            current.store(bigger, memory_order_release);
+            retired.push_back(t);
+            t = bigger;
+        }
+        Put(t, key, c);
+        count++;
+        return c;
+    }
+    // Remove a key, the entries after it which probed past it move back into the hole
+    void Erase(uint64_t key)
+    {
+        lock_guard<mutex> lk(writeLock);
+        Table *t = current.load(memory_order_relaxed);
+        size_t i = Hash(key) & t->mask;
+        while (t->keys[i].load(memory_order_relaxed) != key)
+        {
+            if (t->keys[i].load(memory_order_relaxed) == Empty) { return; }
+            i = (i + 1) & t->mask;
+        }
+        for (size_t j = (i + 1) & t->mask; ; j = (j + 1) & t->mask)
+        {
+            uint64_t k = t->keys[j].load(memory_order_relaxed);
+            if (k == Empty) { break; }
+            // An entry whose home is cyclically in (i, j] stays where it is
+            size_t home = Hash(k) & t->mask;
+            bool stays = (i <= j) ? (i < home && home <= j) : (i < home || home <= j);
+            if (stays) { continue; }
+            t->values[i].store(t->values[j].load(memory_order_relaxed), memory_order_relaxed);
+            t->keys[i].store(k, memory_order_release);
+            i = j;
+        }
+        t->keys[i].store(Empty, memory_order_release);
+        count--;
+    }
+    size_t Size()
+    {
+        lock_guard<mutex> lk(writeLock);
+        return count;
+    }
+    // Bytes taken by the current table
+    size_t Bytes()
+    {
+        lock_guard<mutex> lk(writeLock);
+        Table *t = current.load(memory_order_relaxed);
+        return (t->mask + 1) * (sizeof(atomic<uint64_t>) + sizeof(atomic<Charactor*>));
+    }
 };
-// Initialize static members
-CharactorA_Shared CharactorA::shared;
 
-// The static part of concrete flyweight object CharactorB
-class CharactorB_Shared
+// The shared part of all flyweight objects: metrics of every glyph of the Unicode BMP
+// Kept as one array per attribute, so a glyph costs 8 bytes and a scan over one attribute stays dense
+class GlyphMetrics
 {
-friend class CharactorB;
 private:
-    char _symbol;
-    int _width, _height, _ascent, _descent;
-    CharactorB_Shared()
-    { _symbol = 'B'; _height = 100; _width = 120; _ascent = 70; _descent = 0; }
+    vector<uint16_t> width, height;
+    vector<int16_t> ascent, descent;
+public:
+    static const unsigned Glyphs = 65536;
+    // Built-in metrics, every glyph has the box the old 'A' and 'B' had
+    GlyphMetrics() : width(Glyphs, 120), height(Glyphs, 100), ascent(Glyphs, 70), descent(Glyphs, 0) { }
+    int Width(unsigned cp) { return width[cp]; }
+    int Height(unsigned cp) { return height[cp]; }
+    int Ascent(unsigned cp) { return ascent[cp]; }
+    int Descent(unsigned cp) { return descent[cp]; }
+    void Set(unsigned cp, int w, int h, int a, int d)
+    { width[cp] = w; height[cp] = h; ascent[cp] = a; descent[cp] = d; }
+
+    // Metrics file: "GLYPHMT1", a 32 bit count, then count code points, widths, heights,
+    // ascents and descents, each as an array of 16 bit integers
+    // Glyphs missing in the file keep their metrics, load it before asking for flyweights
+    bool Load(const string &file)
+    {
+        ifstream in(file.c_str(), ios::binary);
+        char magic[8];
+        uint32_t n = 0;
+        if (!in.read(magic, 8) || string(magic, 8) != "GLYPHMT1") { return false; }
+        if (!in.read((char*)&n, sizeof(n)) || n > Glyphs) { return false; }
+        vector<uint16_t> cps(n), w(n), h(n);
+        vector<int16_t> a(n), d(n);
+        in.read((char*)cps.data(), n * 2);
+        in.read((char*)w.data(), n * 2);
+        in.read((char*)h.data(), n * 2);
+        in.read((char*)a.data(), n * 2);
+        in.read((char*)d.data(), n * 2);
+        if (!in) { return false; }
+        for (uint32_t i = 0; i < n; i++)
+        { Set(cps[i], w[i], h[i], a[i], d[i]); }
+        return true;
+    }
+    bool Save(const string &file)
+    {
+        ofstream out(file.c_str(), ios::binary);
+        uint32_t n = Glyphs;
+        vector<uint16_t> cps(n);
+        for (uint32_t i = 0; i < n; i++) { cps[i] = i; }
+        out.write("GLYPHMT1", 8);
+        out.write((const char*)&n, sizeof(n));
+        out.write((const char*)cps.data(), n * 2);
+        out.write((const char*)width.data(), n * 2);
+        out.write((const char*)height.data(), n * 2);
+        out.write((const char*)ascent.data(), n * 2);
+        out.write((const char*)descent.data(), n * 2);
+        return (bool)out;
+    }
+    // Bytes of shared state per glyph
+    static size_t BytesPerGlyph()
+    { return 2 * sizeof(uint16_t) + 2 * sizeof(int16_t); }
 };
-// Another concrete flyweight class
-class CharactorB : public Charactor
+
+// The one concrete flyweight class, its shared attributes are a row of the metrics table
+class Glyph : public Charactor
 {
+friend class CharactorFactory;
 private:
+    // Which row of the metrics table
+    unsigned _codePoint;
     // Stand alone attributes
     int _pointSize;
-    // Shared attributes container
-    static CharactorB_Shared shared;
+    // Bookkeeping of the factory: users holding this glyph, -1 once evicted,
+    // the key it is filed under, and whether it was used since the eviction clock last passed
+    atomic<int> refs;
+    atomic<uint64_t> key;
+    atomic<bool> used;
+
+    // Reuse an evicted glyph for another key
+    void Reset(unsigned cp, int size)
+    {
+        _codePoint = cp;
+        _pointSize = size;
+        key.store(GlyphTable::Key(cp, size), memory_order_relaxed);
+    }
 public:
+    // Shared attributes container
+    static GlyphMetrics metrics;
+
+    Glyph(unsigned cp, int size) : _codePoint(cp), _pointSize(size), refs(0), key(GlyphTable::Key(cp, size)), used(false) { }
     // Implement the interfaces
-    CharactorB(int size) : _pointSize(size) { }
-    virtual char GetSymbol() { return shared._symbol; }
-    virtual int GetWidth() { return shared._width; }
-    virtual int GetHeight() { return shared._height; }
-    virtual int GetAscent() { return shared._ascent; }
-    virtual int GetDescent() { return shared._descent; }
+    virtual char GetSymbol() { return _codePoint < 128 ? (char)_codePoint : '?'; }
+    virtual unsigned GetCodePoint() { return _codePoint; }
+    virtual int GetWidth() { return metrics.Width(_codePoint); }
+    virtual int GetHeight() { return metrics.Height(_codePoint); }
+    virtual int GetAscent() { return metrics.Ascent(_codePoint); }
+    virtual int GetDescent() { return metrics.Descent(_codePoint); }
     virtual int GetPointSize() { return _pointSize; }
     virtual void SetPointSize(int size) { _pointSize = size; }
     virtual void Display()
-    { cout << GetSymbol() << " pointsize: " << GetPointSize() << endl; }
+    {
+        if (_codePoint < 128) { cout << GetSymbol(); }
+        else { cout << "U+" << hex << _codePoint << dec; }
+        cout << " pointsize: " << GetPointSize() << endl;
+    }
 };
 // Initialize static members
-CharactorB_Shared CharactorB::shared;
+GlyphMetrics Glyph::metrics;
+
+// Numbers of the flyweight pool, polled by CharactorFactory::Stats
+struct FactoryStats
+{
+    size_t entries, spares, bytes, hits, misses, evictions;
+};
 
 // The flyweight factory
+// Every GetCharactor holds the flyweight until it is given back with Release.
+// Flyweights nobody holds are evicted once the live ones go over their budget.
+// An evicted flyweight is kept and reused for another key, never deleted, so a reader
+// racing with the eviction still touches a valid object and notices the key has changed.
 class CharactorFactory
 {
 private:
-    // The hash table to record exist flyweight objects
-    map<pair<char,int>, Charactor*> charactors;
+    // Usual point sizes are looked up in a symbol x size array, filled when first asked for
+    static const unsigned DenseSizes = 128;
+    atomic<Charactor*> *dense;
+    // The hash table to record exist flyweight objects of other sizes
+    GlyphTable charactors;
+    // Flyweights filed in the tables, and evicted ones waiting for reuse
+    mutex poolLock;
+    vector<Glyph*> live;
+    vector<Glyph*> spare;
+    // Eviction clock hand over "live", and the budget of live flyweights in bytes
+    size_t hand;
+    size_t budget;
+    atomic<size_t> evictions;
+    // Hit and miss counters, spread over cache lines so threads don't fight over them
+    struct alignas(64) Counters
+    {
+        atomic<size_t> hits, misses;
+    };
+    static const unsigned Stripes = 16;
+    Counters counters[Stripes];
+
     // Singleton class
-    CharactorFactory() { }
+    CharactorFactory() : hand(0), budget((size_t)-1), evictions(0)
+    {
+        dense = new atomic<Charactor*>[256 * DenseSizes];
+        for (unsigned i = 0; i < 256 * DenseSizes; i++) { dense[i].store(NULL, memory_order_relaxed); }
+        for (unsigned i = 0; i < Stripes; i++) { counters[i].hits = 0; counters[i].misses = 0; }
+    }
     static CharactorFactory *instance;
+    static once_flag created;
+
+    Counters& MyCounters()
+    {
+        static atomic<unsigned> threads(0);
+        static thread_local unsigned stripe = threads++ % Stripes;
+        return counters[stripe];
+    }
+    atomic<Charactor*>* DenseSlot(unsigned key, int size)
+    {
+        unsigned s = size - 1;
+        return (key < 256 && s < DenseSizes) ? &dense[key * DenseSizes + s] : NULL;
+    }
+    // Hold a glyph found without lock, fails if it was evicted or reused for another key
+    static bool Pin(Charactor *c, uint64_t k)
+    {
+        Glyph *g = static_cast<Glyph*>(c);
+        int r = g->refs.load(memory_order_relaxed);
+        do
+        { if (r < 0) { return false; } }
+        while (!g->refs.compare_exchange_weak(r, r + 1, memory_order_acquire));
+        if (g->key.load(memory_order_relaxed) != k)
+        {
+            g->refs.fetch_sub(1, memory_order_release);
+            return false;
+        }
+        if (!g->used.load(memory_order_relaxed)) { g->used.store(true, memory_order_relaxed); }
+        return true;
+    }
+    // The slow path, find or file the glyph with the pool locked
+    Charactor* Make(unsigned key, int size)
+    {
+        lock_guard<mutex> lk(poolLock);
+        uint64_t k = GlyphTable::Key(key, size);
+        atomic<Charactor*> *slot = DenseSlot(key, size);
+        Charactor *c = slot ? slot->load(memory_order_acquire) : charactors.Find(k);
+        if (c && Pin(c, k)) { return c; }
+
+        if (key >= GlyphMetrics::Glyphs) { throw key; }
+        Glyph *g;
+        if (spare.empty()) { g = new Glyph(key, size); }
+        else
+        {
+            g = spare.back();
+            spare.pop_back();
+            g->Reset(key, size);
+        }
+        g->used.store(true, memory_order_relaxed);
+        g->refs.store(1, memory_order_release);
+        live.push_back(g);
+        if (slot) { slot->store(g, memory_order_release); }
+        else { charactors.Insert(k, [g]() { return (Charactor*)g; }); }
+        Trim();
+        return g;
+    }
+    // Evict flyweights nobody holds until the live ones fit the budget
+    // CLOCK: a glyph used since the hand last passed gets one more round
+    void Trim()
+    {
+        size_t steps = 0, limit = 2 * live.size();
+        while (live.size() * sizeof(Glyph) > budget && steps++ < limit)
+        {
+            if (hand >= live.size()) { hand = 0; }
+            Glyph *g = live[hand];
+            int zero = 0;
+            if (g->used.load(memory_order_relaxed))
+            {
+                g->used.store(false, memory_order_relaxed);
+                hand++;
+                continue;
+            }
+            if (!g->refs.compare_exchange_strong(zero, -1, memory_order_acquire))
+            { hand++; continue; }
+            uint64_t k = g->key.load(memory_order_relaxed);
+            atomic<Charactor*> *slot = DenseSlot((unsigned)(k >> 32), (int)(uint32_t)k);
+            if (slot) { slot->store(NULL, memory_order_release); }
+            else { charactors.Erase(k); }
+            live[hand] = live.back();
+            live.pop_back();
+            spare.push_back(g);
+            evictions++;
+        }
+    }
 public:
     static CharactorFactory* Instance()
     {
-        if (instance == NULL)
-        { instance = new CharactorFactory(); }
+        call_once(created, []() { instance = new CharactorFactory(); });
         return instance;
     }
-    // Create or reuse a flyweight object
+    // Make a new flyweight object, any code point of the BMP has one
+    static Charactor* Create(unsigned key, int size)
+    {
+        if (key >= GlyphMetrics::Glyphs) { throw key; }
+        return new Glyph(key, size);
+    }
     Charactor* GetCharactor(char key, int size)
+    { return GetCharactor((unsigned)(unsigned char)key, size); }
+    // Code points are often ints, a negative one is out of range like any other
+    Charactor* GetCharactor(int key, int size)
+    { return GetCharactor((unsigned)key, size); }
+    // Create or reuse a flyweight object, safe to call from many threads
+    // Latin-1 code points in usual sizes are in the dense array, the rest in the hash table
+    Charactor* GetCharactor(unsigned key, int size)
     {
-        if (!charactors[pair<char,int>(key, size)])
+        atomic<Charactor*> *slot = DenseSlot(key, size);
+        uint64_t k = GlyphTable::Key(key, size);
+        Charactor *c = slot ? slot->load(memory_order_acquire) : charactors.Find(k);
+        if (c && Pin(c, k))
         {
-            switch (key)
-            {
-                case 'A': 
-                    charactors[pair<char,int>(key, size)] = new CharactorA(size);
-                    break;
-                case 'B': 
-                    charactors[pair<char,int>(key, size)] = new CharactorB(size);
-                    break;
-                default: throw key;
-            }
+            MyCounters().hits.fetch_add(1, memory_order_relaxed);
+            return c;
+        }
+        MyCounters().misses.fetch_add(1, memory_order_relaxed);
+        return Make(key, size);
+    }
+    // Give back a flyweight from GetCharactor, it may be evicted once nobody holds it
+    void Release(Charactor *c)
+    { static_cast<Glyph*>(c)->refs.fetch_sub(1, memory_order_release); }
+    // Bytes allowed for live flyweights, unlimited by default
+    // The dense array, the hash table and the spares are not counted, Stats().bytes has them all.
+    // Spares can't be freed while a reader may still look at them, so they stay outside the budget.
+    void SetLiveBudget(size_t bytes)
+    {
+        lock_guard<mutex> lk(poolLock);
+        budget = bytes;
+        Trim();
+    }
+    FactoryStats Stats()
+    {
+        lock_guard<mutex> lk(poolLock);
+        FactoryStats st;
+        st.entries = live.size();
+        st.spares = spare.size();
+        st.bytes = (live.size() + spare.size()) * sizeof(Glyph) + charactors.Bytes()
+                 + 256 * DenseSizes * sizeof(atomic<Charactor*>);
+        st.hits = st.misses = 0;
+        for (unsigned i = 0; i < Stripes; i++)
+        {
+            st.hits += counters[i].hits.load(memory_order_relaxed);
+            st.misses += counters[i].misses.load(memory_order_relaxed);
         }
-        return charactors[pair<char,int>(key, size)];
+        st.evictions = evictions;
+        return st;
     }
 };
 // Initialize static members
 CharactorFactory *CharactorFactory::instance = 0;
+once_flag CharactorFactory::created;
+
+// The former factory on a std::map, with a lock to share it between threads
+// Only kept to compare with in the benchmark
+class MapCharactorFactory
+{
+private:
+    map<pair<unsigned,int>, Charactor*> charactors;
+    mutex lock;
+public:
+    Charactor* GetCharactor(unsigned key, int size)
+    {
+        lock_guard<mutex> lk(lock);
+        if (!charactors[pair<unsigned,int>(key, size)])
+        { charactors[pair<unsigned,int>(key, size)] = CharactorFactory::Create(key, size); }
+        return charactors[pair<unsigned,int>(key, size)];
+    }
+    void Release(Charactor *) { }
+};
+
+// A factory on the hash table only, to compare with in the benchmark
+class HashCharactorFactory
+{
+private:
+    GlyphTable charactors;
+public:
+    Charactor* GetCharactor(unsigned key, int size)
+    {
+        uint64_t k = GlyphTable::Key(key, size);
+        Charactor *c = charactors.Find(k);
+        if (c) { return c; }
+        return charactors.Insert(k, [=]() { return CharactorFactory::Create(key, size); });
+    }
+    void Release(Charactor *) { }
+    size_t Size() { return charactors.Size(); }
+};
+
+// Lookups per second from 1 to 64 threads, all asking for the same 144 glyphs
+template <class Factory>
+void BenchLookups(const char *name, Factory *factory, size_t lookups)
+{
+    cout << "  " << name << endl;
+    for (int threads = 1; threads <= 64; threads *= 2)
+    {
+        size_t each = lookups / threads;
+        atomic<size_t> found(0);
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        vector<thread> workers;
+        for (int t = 0; t < threads; t++)
+        {
+            workers.push_back(thread([&, t]() {
+                uint32_t x = 2463534242u + t;
+                size_t n = 0;
+                for (size_t i = 0; i < each; i++)
+                {
+                    x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+                    Charactor *c = factory->GetCharactor((unsigned)((x & 1) ? 'A' : 'B'), 1 + (x >> 8) % 72);
+                    n += (c != NULL);
+                    factory->Release(c);
+                }
+                found += n;
+            }));
+        }
+        for (int t = 0; t < threads; t++) { workers[t].join(); }
+        double sec = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout << "    " << threads << " threads: " << (size_t)(found / sec) << " lookups/s" << endl;
+    }
+}
+
+// Decode UTF-8 text to code points, anything outside the BMP or broken becomes U+FFFD
+vector<unsigned> DecodeUtf8(const string &text)
+{
+    vector<unsigned> cps;
+    for (size_t i = 0; i < text.size(); )
+    {
+        unsigned char c = text[i];
+        unsigned cp = 0xFFFD;
+        int len = 1;
+        if (c < 0x80) { cp = c; }
+        else if ((c >> 5) == 0x6 && i + 1 < text.size())
+        { cp = ((c & 0x1F) << 6) | (text[i + 1] & 0x3F); len = 2; }
+        else if ((c >> 4) == 0xE && i + 2 < text.size())
+        { cp = ((c & 0x0F) << 12) | ((text[i + 1] & 0x3F) << 6) | (text[i + 2] & 0x3F); len = 3; }
+        else if ((c >> 3) == 0x1E) { len = 4; }
+        cps.push_back(cp);
+        i += len;
+    }
+    return cps;
+}
+
+// Lay out a text again and again until "glyphs" glyphs are resolved
+// Headings use point size 18, body text 10, and every 50th line is a banner in size 200
+template <class Factory>
+void BenchLayout(const char *name, Factory *factory, const vector<unsigned> &text, size_t glyphs)
+{
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    size_t done = 0, width = 0, line = 0;
+    int size = 10;
+    bool lineStart = true;
+    while (done < glyphs)
+    {
+        for (size_t i = 0; i < text.size() && done < glyphs; i++)
+        {
+            unsigned cp = text[i];
+            if (lineStart)
+            {
+                line++;
+                size = (line % 50 == 0) ? 200 : ((cp == '#' || cp == '*') ? 18 : 10);
+                lineStart = false;
+            }
+            if (cp == '\n') { lineStart = true; continue; }
+            Charactor *c = factory->GetCharactor(cp, size);
+            width += c->GetWidth() * size;
+            factory->Release(c);
+            done++;
+        }
+    }
+    double sec = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cout << "  " << name << ": " << done << " glyphs in " << sec << " s, "
+         << (size_t)(done / sec) << " glyphs/s (width " << width << ")" << endl;
+}
+
+// Memory of the shared state and load time of a metrics file with all 65536 glyphs
+void BenchMetrics()
+{
+    const string file = "bench_glyphs.bin";
+    GlyphMetrics built;
+    for (unsigned cp = 0; cp < GlyphMetrics::Glyphs; cp++)
+    { built.Set(cp, 40 + cp % 90, 100, 70 + cp % 5, cp % 3 == 0 ? 20 : 0); }
+    if (!built.Save(file)) { cout << "Can't write " << file << endl; return; }
+
+    GlyphMetrics loaded;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    bool ok = loaded.Load(file);
+    double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    remove(file.c_str());
+
+    cout << "Metrics benchmark: " << GlyphMetrics::Glyphs << " glyphs" << endl;
+    cout << "  shared state: " << GlyphMetrics::BytesPerGlyph() << " bytes/glyph, "
+         << GlyphMetrics::BytesPerGlyph() * GlyphMetrics::Glyphs / 1024 << " KB in total" << endl;
+    cout << "  flyweight object: " << sizeof(Glyph) << " bytes per (glyph, point size)" << endl;
+    cout << "  load: " << (ok ? "" : "FAILED, ") << ms << " ms" << endl;
+}
+
+// Steady state memory under a stream of random sizes, 26 letters x 2000 sizes
+// Each glyph is held only for its lookup, the live glyphs have to stay within the budget
+void BenchMemory(size_t lookups, size_t budget)
+{
+    CharactorFactory *factory = CharactorFactory::Instance();
+    factory->SetLiveBudget(budget);
+    HashCharactorFactory unbounded;
+    cout << "Memory benchmark: " << lookups << " lookups, live glyph budget " << budget / 1024 << " KB" << endl;
+    mt19937 rng(1);
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for (size_t i = 1; i <= lookups; i++)
+    {
+        unsigned cp = 'a' + rng() % 26;
+        int size = 1 + rng() % 2000;
+        factory->Release(factory->GetCharactor(cp, size));
+        unbounded.GetCharactor(cp, size);
+        if (i % (lookups / 5) == 0)
+        {
+            FactoryStats st = factory->Stats();
+            size_t liveBytes = st.entries * sizeof(Glyph);
+            cout << "  after " << i << ": " << st.entries << " entries, " << liveBytes / 1024 << " KB live"
+                 << (liveBytes > budget ? " (OVER BUDGET)" : "") << ", " << st.spares << " spares, "
+                 << st.bytes / 1024 << " KB in all, hit rate " << (100.0 * st.hits / (st.hits + st.misses))
+                 << "%, " << st.evictions << " evictions; unbounded pool "
+                 << unbounded.Size() << " entries, " << unbounded.Size() * sizeof(Glyph) / 1024 << " KB" << endl;
+        }
+    }
+    double sec = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cout << "  " << (size_t)(lookups / sec) << " lookups/s for both pools" << endl;
+}
 
 // Test Flyweight pattern
-int main()
+// Run "main bench [lookup|layout [file] [glyphs]|metrics|memory]" for the benchmarks
+int main(int argc, char *argv[])
 {
+    if (argc > 1 && string(argv[1]) == "bench")
+    {
+        string which = (argc > 2) ? argv[2] : "";
+        if (which == "" || which == "lookup")
+        {
+            const size_t lookups = 10000000;
+            cout << "Lookup benchmark: " << lookups << " lookups per run" << endl;
+            MapCharactorFactory mapFactory;
+            HashCharactorFactory hashFactory;
+            BenchLookups("std::map with a lock", &mapFactory, lookups);
+            BenchLookups("lock free hash table", &hashFactory, lookups);
+            BenchLookups("dense table with hash fallback", CharactorFactory::Instance(), lookups);
+        }
+        if (which == "" || which == "layout")
+        {
+            string file = (argc > 3) ? argv[3] : "../README.md";
+            size_t glyphs = (argc > 4) ? atol(argv[4]) : 100000000;
+            ifstream in(file.c_str());
+            vector<unsigned> text = DecodeUtf8(string((istreambuf_iterator<char>(in)), istreambuf_iterator<char>()));
+            if (text.empty()) { cout << "Can't read " << file << endl; return 1; }
+            cout << "Layout benchmark: " << file << ", " << text.size() << " code points, " << glyphs << " glyphs" << endl;
+            MapCharactorFactory mapFactory;
+            HashCharactorFactory hashFactory;
+            BenchLayout("std::map with a lock (1/10 of the glyphs)", &mapFactory, text, glyphs / 10);
+            BenchLayout("lock free hash table", &hashFactory, text, glyphs);
+            BenchLayout("dense table with hash fallback", CharactorFactory::Instance(), text, glyphs);
+        }
+        if (which == "" || which == "metrics")
+        { BenchMetrics(); }
+        if (which == "" || which == "memory")
+        { BenchMemory(5000000, 256 * 1024); }
+        return 0;
+    }
+
     // Frist charactor "A"
     Charactor *ca_1 = CharactorFactory::Instance()->GetCharactor('A', 10);
     ca_1->Display();
@@ -163,6 +706,19 @@ int main()
     ca_3->Display();
     cout << "Ca_1 and Ca_3 " << (ca_1 == ca_3 ? "is" : "is NOT" ) << " the same" << endl;
 
+    // Any other glyph of the BMP, its metrics come from the same table
+    Charactor *cz = CharactorFactory::Instance()->GetCharactor(0x4E2Du, 10);
+    cz->Display();
+    cout << "Width " << cz->GetWidth() << ", height " << cz->GetHeight() << endl;
+
+    // Give the flyweights back, unused ones can be evicted when memory runs short
+    CharactorFactory::Instance()->Release(ca_1);
+    CharactorFactory::Instance()->Release(ca_2);
+    CharactorFactory::Instance()->Release(ca_3);
+    CharactorFactory::Instance()->Release(cz);
+    FactoryStats st = CharactorFactory::Instance()->Stats();
+    cout << st.entries << " flyweights, " << st.hits << " hits, " << st.misses << " misses" << endl;
+
     // The end
     return 0;
 }
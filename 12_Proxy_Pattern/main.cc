@@ -12,17 +12,159 @@
  */
 
 #include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include <cmath>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <unordered_set>
+#include <cstdlib>
+#include <cerrno>
+#include <stdexcept>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <poll.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 using namespace std;
 
+// Array kernels of the four operations: out[i] = x[i] op y[i]
+// Picked once at start by what the CPU supports: AVX2, SSE2, or plain C++
+typedef void (*MathKernel)(const double *x, const double *y, double *out, size_t n);
+enum MathOp { OpAdd, OpSub, OpMul, OpDev };
+
+template <int Op>
+void ScalarKernel(const double *x, const double *y, double *out, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        switch (Op)
+        {
+            case OpAdd: out[i] = x[i] + y[i]; break;
+            case OpSub: out[i] = x[i] - y[i]; break;
+            case OpMul: out[i] = x[i] * y[i]; break;
+            default: out[i] = x[i] / y[i]; break;
+        }
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+template <int Op>
+__attribute__((target("sse2")))
+void Sse2Kernel(const double *x, const double *y, double *out, size_t n)
+{
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2)
+    {
+        __m128d a = _mm_loadu_pd(x + i), b = _mm_loadu_pd(y + i), r;
+        switch (Op)
+        {
+            case OpAdd: r = _mm_add_pd(a, b); break;
+            case OpSub: r = _mm_sub_pd(a, b); break;
+            case OpMul: r = _mm_mul_pd(a, b); break;
+            default: r = _mm_div_pd(a, b); break;
+        }
+        _mm_storeu_pd(out + i, r);
+    }
+    ScalarKernel<Op>(x + i, y + i, out + i, n - i);
+}
+
+template <int Op>
+__attribute__((target("avx2")))
+void Avx2Kernel(const double *x, const double *y, double *out, size_t n)
+{
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        __m256d a = _mm256_loadu_pd(x + i), b = _mm256_loadu_pd(y + i), r;
+        switch (Op)
+        {
+            case OpAdd: r = _mm256_add_pd(a, b); break;
+            case OpSub: r = _mm256_sub_pd(a, b); break;
+            case OpMul: r = _mm256_mul_pd(a, b); break;
+            default: r = _mm256_div_pd(a, b); break;
+        }
+        _mm256_storeu_pd(out + i, r);
+    }
+    ScalarKernel<Op>(x + i, y + i, out + i, n - i);
+}
+#endif
+
+// The kernel set in use
+class MathKernels
+{
+private:
+    MathKernel kernels[4];
+    string name;
+    MathKernels() { Select(""); }
+public:
+    static MathKernels& Instance()
+    {
+        static MathKernels instance;
+        return instance;
+    }
+    // Use the named kernel set ("avx2", "sse2" or "scalar"), or the best one for an empty name
+    // Return false if the CPU can't run it
+    bool Select(const string &want)
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_cpu_init();
+        if ((want == "" || want == "avx2") && __builtin_cpu_supports("avx2"))
+        {
+            MathKernel k[4] = { Avx2Kernel<OpAdd>, Avx2Kernel<OpSub>, Avx2Kernel<OpMul>, Avx2Kernel<OpDev> };
+            copy(k, k + 4, kernels);
+            name = "avx2";
+            return true;
+        }
+        if ((want == "" || want == "sse2") && __builtin_cpu_supports("sse2"))
+        {
+            MathKernel k[4] = { Sse2Kernel<OpAdd>, Sse2Kernel<OpSub>, Sse2Kernel<OpMul>, Sse2Kernel<OpDev> };
+            copy(k, k + 4, kernels);
+            name = "sse2";
+            return true;
+        }
+#endif
+        if (want == "" || want == "scalar")
+        {
+            MathKernel k[4] = { ScalarKernel<OpAdd>, ScalarKernel<OpSub>, ScalarKernel<OpMul>, ScalarKernel<OpDev> };
+            copy(k, k + 4, kernels);
+            name = "scalar";
+            return true;
+        }
+        return false;
+    }
+    MathKernel Get(MathOp op) { return kernels[op]; }
+    string Name() { return name; }
+};
+
 // Public interface
 class IMath
 {
 public:
+    virtual ~IMath() { }
     // Interfaces
     virtual double Add(double x,double y) = 0;
     virtual double Sub(double x,double y) = 0;
     virtual double Mul(double x,double y) = 0;
     virtual double Dev(double x,double y) = 0;
+    // Array interfaces, out[i] = x[i] op y[i], one virtual call for the whole array
+    // By default they call the element interfaces, servers override them with faster ones
+    virtual void AddN(const double *x, const double *y, double *out, size_t n)
+    { for (size_t i = 0; i < n; i++) { out[i] = Add(x[i], y[i]); } }
+    virtual void SubN(const double *x, const double *y, double *out, size_t n)
+    { for (size_t i = 0; i < n; i++) { out[i] = Sub(x[i], y[i]); } }
+    virtual void MulN(const double *x, const double *y, double *out, size_t n)
+    { for (size_t i = 0; i < n; i++) { out[i] = Mul(x[i], y[i]); } }
+    virtual void DevN(const double *x, const double *y, double *out, size_t n)
+    { for (size_t i = 0; i < n; i++) { out[i] = Dev(x[i], y[i]); } }
 };
 
 // The original server class
@@ -34,6 +176,14 @@ public:
     double Sub(double x,double y) { return x - y; }
     double Mul(double x,double y) { return x * y; }
     double Dev(double x,double y) { return x / y; }
+    void AddN(const double *x, const double *y, double *out, size_t n)
+    { MathKernels::Instance().Get(OpAdd)(x, y, out, n); }
+    void SubN(const double *x, const double *y, double *out, size_t n)
+    { MathKernels::Instance().Get(OpSub)(x, y, out, n); }
+    void MulN(const double *x, const double *y, double *out, size_t n)
+    { MathKernels::Instance().Get(OpMul)(x, y, out, n); }
+    void DevN(const double *x, const double *y, double *out, size_t n)
+    { MathKernels::Instance().Get(OpDev)(x, y, out, n); }
 };
 
 // The proxy class
@@ -42,6 +192,9 @@ class MathProxy : public IMath
 private:
     // Contain the original class
     Math math;
+    // The extra process of this proxy, on a whole array
+    static void Extra(double *out, size_t n)
+    { for (size_t i = 0; i < n; i++) { out[i] += 100; } }
 public:
     // Implement the interface
     double Add(double x,double y)
@@ -52,11 +205,989 @@ public:
     { return math.Mul(x,y) + 100; }
     double Dev(double x,double y)
     { return math.Dev(x,y) + 100; }
+    void AddN(const double *x, const double *y, double *out, size_t n)
+    { math.AddN(x, y, out, n); Extra(out, n); }
+    void SubN(const double *x, const double *y, double *out, size_t n)
+    { math.SubN(x, y, out, n); Extra(out, n); }
+    void MulN(const double *x, const double *y, double *out, size_t n)
+    { math.MulN(x, y, out, n); Extra(out, n); }
+    void DevN(const double *x, const double *y, double *out, size_t n)
+    { math.DevN(x, y, out, n); Extra(out, n); }
+};
+
+// Which entry of the cache to throw away when it is full
+// One policy object per cache shard, the shard lock is held while it is called
+class EvictionPolicy
+{
+public:
+    virtual ~EvictionPolicy() { }
+    // A new entry was put into "slot", or an entry in "slot" was used again
+    virtual void Inserted(size_t slot) = 0;
+    virtual void Touched(size_t slot) = 0;
+    // Choose the slot to reuse, all slots are in use when it is called
+    virtual size_t Victim() = 0;
+    // A fresh policy of the same kind for another shard
+    virtual EvictionPolicy* Clone() = 0;
+};
+
+// Least recently used, slots are linked in use order
+class LruPolicy : public EvictionPolicy
+{
+private:
+    enum { None = -1 };
+    vector<size_t> prev, next;
+    size_t head, tail;
+
+    void Unlink(size_t s)
+    {
+        if (prev[s] != (size_t)None) { next[prev[s]] = next[s]; } else { head = next[s]; }
+        if (next[s] != (size_t)None) { prev[next[s]] = prev[s]; } else { tail = prev[s]; }
+    }
+    void PushFront(size_t s)
+    {
+        prev[s] = None;
+        next[s] = head;
+        if (head != (size_t)None) { prev[head] = s; } else { tail = s; }
+        head = s;
+    }
+public:
+    LruPolicy() : head(None), tail(None) { }
+    void Inserted(size_t slot)
+    {
+        if (slot >= prev.size()) { prev.resize(slot + 1, (size_t)None); next.resize(slot + 1, (size_t)None); }
+        else { Unlink(slot); }
+        PushFront(slot);
+    }
+    void Touched(size_t slot)
+    {
+        if (slot == head) { return; }
+        Unlink(slot);
+        PushFront(slot);
+    }
+    size_t Victim() { return tail; }
+    EvictionPolicy* Clone() { return new LruPolicy(); }
+};
+
+// CLOCK, an approximation of LRU which only sets a bit on use
+class ClockPolicy : public EvictionPolicy
+{
+private:
+    vector<bool> referenced;
+    size_t hand;
+public:
+    ClockPolicy() : hand(0) { }
+    void Inserted(size_t slot)
+    {
+        if (slot >= referenced.size()) { referenced.resize(slot + 1, false); }
+        referenced[slot] = false;
+    }
+    void Touched(size_t slot) { referenced[slot] = true; }
+    size_t Victim()
+    {
+        while (referenced[hand])
+        {
+            referenced[hand] = false;
+            hand = (hand + 1) % referenced.size();
+        }
+        size_t v = hand;
+        hand = (hand + 1) % referenced.size();
+        return v;
+    }
+    EvictionPolicy* Clone() { return new ClockPolicy(); }
 };
 
+// Statistics of a caching proxy
+struct CacheStats
+{
+    size_t hits, misses, evictions, entries;
+};
+
+// The caching proxy, it remembers results of an expensive IMath server
+// Results are kept per (operation, x, y) in shards with their own lock and eviction policy.
+// The server is called without any lock held, two threads missing on the same key both call it.
+class CachingMathProxy : public IMath
+{
+private:
+    struct Key
+    {
+        uint64_t x, y;
+        char op;
+        bool operator==(const Key &k) const { return x == k.x && y == k.y && op == k.op; }
+    };
+    struct KeyHash
+    {
+        size_t operator()(const Key &k) const
+        {
+            uint64_t h = (k.x * 0x9e3779b97f4a7c15ULL) ^ (k.y * 0xc2b2ae3d27d4eb4fULL) ^ (uint64_t)k.op;
+            h ^= h >> 29; h *= 0xbf58476d1ce4e5b9ULL; h ^= h >> 32;
+            return h;
+        }
+    };
+    struct Entry
+    {
+        Key key;
+        double value;
+    };
+    // Entries never move, so the policy can track them by slot
+    // The index is an open addressing table of slot + 1, 0 for empty, kept at most half full
+    struct Shard
+    {
+        mutex lock;
+        vector<uint32_t> index;
+        vector<Entry> entries;
+        EvictionPolicy *policy;
+        // Entries kept at most, reserve() may give the vector more room than that
+        size_t capacity;
+        size_t hits, misses, evictions;
+        Shard(size_t cap, EvictionPolicy *p) : policy(p), capacity(cap), hits(0), misses(0), evictions(0)
+        {
+            size_t n = 16;
+            while (n < capacity * 2) { n *= 2; }
+            index.resize(n, 0);
+            entries.reserve(capacity);
+        }
+        ~Shard() { delete policy; }
+        // Position in the index holding the key, or the empty one where it would go
+        size_t Probe(const Key &k, size_t h)
+        {
+            size_t mask = index.size() - 1;
+            size_t i = h & mask;
+            while (index[i] && !(entries[index[i] - 1].key == k)) { i = (i + 1) & mask; }
+            return i;
+        }
+        // Take the entry at index position i out, shift the following ones back into the hole
+        void Erase(size_t i)
+        {
+            size_t mask = index.size() - 1;
+            for (size_t j = (i + 1) & mask; index[j]; j = (j + 1) & mask)
+            {
+                size_t home = KeyHash()(entries[index[j] - 1].key) & mask;
+                bool stays = (i <= j) ? (i < home && home <= j) : (i < home || home <= j);
+                if (stays) { continue; }
+                index[i] = index[j];
+                i = j;
+            }
+            index[i] = 0;
+        }
+    };
+    IMath *math;
+    vector<Shard*> shards;
+
+    // Keys compare the bits of the operands, so -0.0 and 0.0 or two NaNs are told apart correctly
+    static Key MakeKey(char op, double x, double y)
+    {
+        Key k;
+        memcpy(&k.x, &x, sizeof(x));
+        memcpy(&k.y, &y, sizeof(y));
+        k.op = op;
+        return k;
+    }
+    template <class Call>
+    double Cached(char op, double x, double y, Call call)
+    {
+        Key k = MakeKey(op, x, y);
+        size_t h = KeyHash()(k);
+        Shard *s = shards[(h >> 40) % shards.size()];
+        {
+            lock_guard<mutex> lk(s->lock);
+            size_t i = s->Probe(k, h);
+            if (s->index[i])
+            {
+                s->hits++;
+                s->policy->Touched(s->index[i] - 1);
+                return s->entries[s->index[i] - 1].value;
+            }
+            s->misses++;
+        }
+        double v = call();
+        lock_guard<mutex> lk(s->lock);
+        size_t i = s->Probe(k, h);
+        if (s->index[i]) { return v; }
+        size_t slot;
+        if (s->entries.size() < s->capacity)
+        {
+            slot = s->entries.size();
+            s->entries.push_back(Entry());
+        }
+        else
+        {
+            slot = s->policy->Victim();
+            s->Erase(s->Probe(s->entries[slot].key, KeyHash()(s->entries[slot].key)));
+            s->evictions++;
+            i = s->Probe(k, h);
+        }
+        s->entries[slot].key = k;
+        s->entries[slot].value = v;
+        s->index[i] = slot + 1;
+        s->policy->Inserted(slot);
+        return v;
+    }
+public:
+    // Remember up to "capacity" results, the policy is copied for each shard
+    CachingMathProxy(IMath *m, size_t capacity, EvictionPolicy *policy, int shardCount = 16) : math(m)
+    {
+        size_t shardCapacity = max((size_t)1, capacity / shardCount);
+        for (int i = 0; i < shardCount; i++)
+        { shards.push_back(new Shard(shardCapacity, policy->Clone())); }
+        delete policy;
+    }
+    ~CachingMathProxy()
+    { for (size_t i = 0; i < shards.size(); i++) { delete shards[i]; } }
+    // Implement the interface
+    double Add(double x,double y)
+    { return Cached('+', x, y, [&]() { return math->Add(x,y); }); }
+    double Sub(double x,double y)
+    { return Cached('-', x, y, [&]() { return math->Sub(x,y); }); }
+    double Mul(double x,double y)
+    { return Cached('*', x, y, [&]() { return math->Mul(x,y); }); }
+    double Dev(double x,double y)
+    { return Cached('/', x, y, [&]() { return math->Dev(x,y); }); }
+
+    CacheStats Stats()
+    {
+        CacheStats st = { 0, 0, 0, 0 };
+        for (size_t i = 0; i < shards.size(); i++)
+        {
+            lock_guard<mutex> lk(shards[i]->lock);
+            st.hits += shards[i]->hits;
+            st.misses += shards[i]->misses;
+            st.evictions += shards[i]->evictions;
+            st.entries += shards[i]->entries.size();
+        }
+        return st;
+    }
+};
+
+// An expensive server, stands for a real backend in the benchmark
+class SlowMath : public IMath
+{
+private:
+    Math math;
+    int work;
+    // Burn some time, about "work" dependent floating point steps
+    double Burn(double v)
+    {
+        for (int i = 0; i < work; i++) { v = sqrt(v * v + 1.0); }
+        return v;
+    }
+public:
+    // Result of the burnt steps, only kept so they are not optimized away
+    atomic<double> noise;
+    SlowMath(int w) : work(w), noise(0) { }
+    double Add(double x,double y) { noise.store(Burn(x), memory_order_relaxed); return math.Add(x,y); }
+    double Sub(double x,double y) { noise.store(Burn(x), memory_order_relaxed); return math.Sub(x,y); }
+    double Mul(double x,double y) { noise.store(Burn(x), memory_order_relaxed); return math.Mul(x,y); }
+    double Dev(double x,double y) { noise.store(Burn(x), memory_order_relaxed); return math.Dev(x,y); }
+};
+
+// Nanoseconds per call, spread over "threads" threads, operands from "keys" distinct pairs
+// keys == 0 makes every call use new operands, so every call misses
+double TimeCalls(IMath *m, int threads, size_t calls, size_t keys)
+{
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    vector<thread> workers;
+    atomic<double> sink(0);
+    for (int t = 0; t < threads; t++)
+    {
+        workers.push_back(thread([&, t]() {
+            uint32_t r = 12345 + t;
+            double sum = 0;
+            size_t each = calls / threads;
+            for (size_t i = 0; i < each; i++)
+            {
+                r ^= r << 13; r ^= r >> 17; r ^= r << 5;
+                double x = keys ? (double)(r % keys) : (double)(t * each + i);
+                switch (r >> 30)
+                {
+                    case 0: sum += m->Add(x, 3); break;
+                    case 1: sum += m->Sub(x, 3); break;
+                    case 2: sum += m->Mul(x, 3); break;
+                    default: sum += m->Dev(x, 3); break;
+                }
+            }
+            sink = sink + sum;
+        }));
+    }
+    for (int t = 0; t < threads; t++) { workers[t].join(); }
+    return chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / calls;
+}
+
+// Hit heavy and miss heavy workloads against the server called directly
+// Hit heavy calls use 500 x values (2000 keys with the four operations), miss heavy ones never repeat
+void BenchCache(size_t calls)
+{
+    SlowMath slow(50);
+    cout << "Caching proxy benchmark: " << calls << " calls, server of 50 sqrt steps, cache of 4096 results" << endl;
+    double directNs = TimeCalls(&slow, 1, calls, 0);
+    cout << "  server called directly: " << directNs << " ns/call" << endl;
+    const char *names[] = { "LRU", "CLOCK" };
+    for (int p = 0; p < 2; p++)
+    {
+        EvictionPolicy *policy = (p == 0) ? (EvictionPolicy*)new LruPolicy() : (EvictionPolicy*)new ClockPolicy();
+        for (int threads = 1; threads <= 4; threads *= 4)
+        {
+            CachingMathProxy hot(&slow, 4096, policy->Clone());
+            double hitNs = TimeCalls(&hot, threads, calls, 500);
+            CacheStats st = hot.Stats();
+            CachingMathProxy cold(&slow, 4096, policy->Clone());
+            double missNs = TimeCalls(&cold, threads, calls, 0);
+            cout << "  " << names[p] << ", " << threads << " threads: hit heavy " << hitNs << " ns/call ("
+                 << (100.0 * st.hits / (st.hits + st.misses)) << "% hits), miss heavy " << missNs
+                 << " ns/call (" << (missNs - directNs) << " ns over the server)" << endl;
+        }
+        delete policy;
+    }
+}
+
+// Wire format of the remote proxy, fixed size frames in the native byte order of the host
+// A request names the operation, a response gives back the id of its request with the result
+struct MathRequest
+{
+    uint64_t id;
+    uint32_t op;
+    uint32_t pad;
+    double x, y;
+};
+struct MathResponse
+{
+    uint64_t id;
+    double value;
+};
+
+// Write all bytes, or throw if the other side went away
+void WriteAll(int fd, const void *buf, size_t len)
+{
+    const char *p = (const char*)buf;
+    while (len > 0)
+    {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) { continue; }
+        if (n <= 0) { throw runtime_error("math socket write failed"); }
+        p += n;
+        len -= n;
+    }
+}
+
+// The server side of the remote proxy, serves an IMath over a Unix domain socket
+// Each read takes as many requests as have arrived, and all their results go back in one write
+class MathServer
+{
+private:
+    IMath *math;
+    int listenFd;
+    string path;
+
+    void Serve(int fd)
+    {
+        vector<char> in(64 * 1024);
+        vector<MathResponse> out;
+        size_t have = 0;
+        while (true)
+        {
+            ssize_t n = read(fd, in.data() + have, in.size() - have);
+            if (n < 0 && errno == EINTR) { continue; }
+            if (n <= 0) { break; }
+            have += n;
+            size_t count = have / sizeof(MathRequest);
+            out.resize(count);
+            for (size_t i = 0; i < count; i++)
+            {
+                MathRequest r;
+                memcpy(&r, in.data() + i * sizeof(MathRequest), sizeof(r));
+                out[i].id = r.id;
+                switch (r.op)
+                {
+                    case OpAdd: out[i].value = math->Add(r.x, r.y); break;
+                    case OpSub: out[i].value = math->Sub(r.x, r.y); break;
+                    case OpMul: out[i].value = math->Mul(r.x, r.y); break;
+                    default: out[i].value = math->Dev(r.x, r.y); break;
+                }
+            }
+            WriteAll(fd, out.data(), count * sizeof(MathResponse));
+            // Keep a partly arrived request for the next read
+            size_t used = count * sizeof(MathRequest);
+            memmove(in.data(), in.data() + used, have - used);
+            have -= used;
+        }
+        close(fd);
+    }
+public:
+    MathServer(const string &socketPath, IMath *m) : math(m), path(socketPath)
+    {
+        listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+        unlink(path.c_str());
+        if (listenFd < 0 || bind(listenFd, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(listenFd, 16) < 0)
+        { throw runtime_error("can't listen on " + path); }
+    }
+    ~MathServer()
+    {
+        close(listenFd);
+        unlink(path.c_str());
+    }
+    // Serve "connections" clients one after another, 0 for no end
+    void Run(int connections)
+    {
+        for (int i = 0; connections == 0 || i < connections; i++)
+        {
+            int fd = accept(listenFd, NULL, NULL);
+            if (fd < 0) { if (errno == EINTR) { i--; continue; } break; }
+            Serve(fd);
+        }
+    }
+};
+
+// The remote proxy, forwards each call to a MathServer in another process
+// Element calls take one round trip each. The array calls pipeline: requests go out in
+// batches, up to "window" requests are on the way, and results are read while sending.
+class RemoteMathProxy : public IMath
+{
+private:
+    int fd;
+    uint64_t nextId;
+    size_t batch, window;
+    vector<MathRequest> sendBuf;
+    vector<MathResponse> recvBuf;
+
+    // Read exactly "count" responses into recvBuf
+    void ReadResponses(size_t count)
+    {
+        recvBuf.resize(count);
+        char *p = (char*)recvBuf.data();
+        size_t len = count * sizeof(MathResponse);
+        while (len > 0)
+        {
+            ssize_t n = read(fd, p, len);
+            if (n < 0 && errno == EINTR) { continue; }
+            if (n <= 0) { throw runtime_error("math socket read failed"); }
+            p += n;
+            len -= n;
+        }
+    }
+    double Call(MathOp op, double x, double y)
+    {
+        MathRequest r = { nextId++, (uint32_t)op, 0, x, y };
+        WriteAll(fd, &r, sizeof(r));
+        ReadResponses(1);
+        if (recvBuf[0].id != r.id) { throw runtime_error("math response for another request"); }
+        return recvBuf[0].value;
+    }
+    // Send and receive at the same time, so neither side can block on a full socket
+    void CallN(MathOp op, const double *x, const double *y, double *out, size_t n)
+    {
+        uint64_t first = nextId;
+        size_t sent = 0, received = 0, sendOff = 0, sendLen = 0;
+        vector<char> in(64 * 1024);
+        vector<bool> got(n, false);
+        size_t have = 0;
+        while (received < n)
+        {
+            // Next batch, as long as the window allows it
+            if (sendOff == sendLen && sent < n && sent - received < window)
+            {
+                size_t k = min(batch, min(n - sent, window - (sent - received)));
+                sendBuf.resize(k);
+                for (size_t i = 0; i < k; i++)
+                {
+                    MathRequest r = { nextId++, (uint32_t)op, 0, x[sent + i], y[sent + i] };
+                    sendBuf[i] = r;
+                }
+                sent += k;
+                sendOff = 0;
+                sendLen = k * sizeof(MathRequest);
+            }
+            pollfd pfd = { fd, (short)(POLLIN | (sendOff < sendLen ? POLLOUT : 0)), 0 };
+            if (poll(&pfd, 1, -1) < 0)
+            {
+                if (errno == EINTR) { continue; }
+                throw runtime_error("math socket poll failed");
+            }
+            if (pfd.revents & POLLOUT)
+            {
+                ssize_t w = send(fd, (char*)sendBuf.data() + sendOff, sendLen - sendOff, MSG_DONTWAIT | MSG_NOSIGNAL);
+                if (w > 0) { sendOff += w; }
+                else if (errno != EAGAIN && errno != EINTR) { throw runtime_error("math socket write failed"); }
+            }
+            if (pfd.revents & POLLIN)
+            {
+                ssize_t r = read(fd, in.data() + have, in.size() - have);
+                if (r == 0 || (r < 0 && errno != EINTR)) { throw runtime_error("math socket read failed"); }
+                if (r > 0) { have += r; }
+                size_t count = have / sizeof(MathResponse);
+                for (size_t i = 0; i < count; i++)
+                {
+                    MathResponse resp;
+                    memcpy(&resp, in.data() + i * sizeof(MathResponse), sizeof(resp));
+                    // Only requests sent by this call, each once, a stray response must not land outside "out"
+                    uint64_t k = resp.id - first;
+                    if (k >= sent || got[k]) { throw runtime_error("math response for another request"); }
+                    got[k] = true;
+                    out[k] = resp.value;
+                }
+                received += count;
+                size_t used = count * sizeof(MathResponse);
+                memmove(in.data(), in.data() + used, have - used);
+                have -= used;
+            }
+            else if (pfd.revents & (POLLERR | POLLHUP))
+            { throw runtime_error("math socket closed"); }
+        }
+    }
+public:
+    // "window" bounds the requests in flight
+    RemoteMathProxy(const string &path, size_t batchSize = 256, size_t windowSize = 2048)
+        : nextId(0), batch(max((size_t)1, batchSize)), window(max(batch, windowSize))
+    {
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+        // The server may still be starting
+        int tries = 0;
+        while (connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0)
+        {
+            if (++tries > 500) { close(fd); throw runtime_error("can't connect to " + path); }
+            this_thread::sleep_for(chrono::milliseconds(10));
+        }
+    }
+    ~RemoteMathProxy() { close(fd); }
+    // Implement the interface
+    double Add(double x,double y) { return Call(OpAdd, x, y); }
+    double Sub(double x,double y) { return Call(OpSub, x, y); }
+    double Mul(double x,double y) { return Call(OpMul, x, y); }
+    double Dev(double x,double y) { return Call(OpDev, x, y); }
+    void AddN(const double *x, const double *y, double *out, size_t n) { CallN(OpAdd, x, y, out, n); }
+    void SubN(const double *x, const double *y, double *out, size_t n) { CallN(OpSub, x, y, out, n); }
+    void MulN(const double *x, const double *y, double *out, size_t n) { CallN(OpMul, x, y, out, n); }
+    void DevN(const double *x, const double *y, double *out, size_t n) { CallN(OpDev, x, y, out, n); }
+};
+
+// Start a MathServer in a child process, it serves "connections" clients and exits
+pid_t StartMathServer(const string &path, int connections)
+{
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        {
+            Math math;
+            MathServer server(path, &math);
+            server.Run(connections);
+        }
+        _exit(0);
+    }
+    return pid;
+}
+
+// Calls per second and latency of one at a time calls and of pipelined array calls
+void BenchRemote(size_t calls)
+{
+    string path = "/tmp/imath-bench-" + to_string(getpid()) + ".sock";
+    size_t batches[] = { 1, 16, 256 };
+    pid_t server = StartMathServer(path, 4);
+    cout << "Remote proxy benchmark: " << calls << " calls over " << path << endl;
+    {
+        RemoteMathProxy remote(path);
+        vector<double> ns;
+        double sum = 0;
+        for (size_t i = 0; i < calls / 10; i++)
+        {
+            chrono::steady_clock::time_point start = chrono::steady_clock::now();
+            sum += remote.Add(i, 1);
+            ns.push_back(chrono::duration<double, nano>(chrono::steady_clock::now() - start).count());
+        }
+        double total = 0;
+        for (size_t i = 0; i < ns.size(); i++) { total += ns[i]; }
+        sort(ns.begin(), ns.end());
+        cout << "  one at a time: " << (size_t)(ns.size() / (total / 1e9)) << " calls/s, latency p50 "
+             << ns[ns.size() / 2] / 1000 << " us, p99 " << ns[ns.size() * 99 / 100] / 1000 << " us" << endl;
+    }
+    vector<double> x(calls), y(calls, 2.0), out(calls);
+    for (size_t i = 0; i < calls; i++) { x[i] = i; }
+    for (int b = 0; b < 3; b++)
+    {
+        RemoteMathProxy remote(path, batches[b], 2048);
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        remote.MulN(x.data(), y.data(), out.data(), calls);
+        double sec = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        bool ok = true;
+        for (size_t i = 0; i < calls; i++) { ok = ok && out[i] == x[i] * 2.0; }
+        cout << "  pipelined, batches of " << batches[b] << ": " << (size_t)(calls / sec) << " calls/s, "
+             << sec / calls * 1e9 << " ns/call" << (ok ? "" : " (WRONG RESULTS)") << endl;
+    }
+    waitpid(server, NULL, 0);
+}
+
+// Cheap time stamps for the instrumenting proxy
+// On x86 the TSC, turned into nanoseconds by a rate measured once against steady_clock
+class CallClock
+{
+private:
+    double nsPerTick;
+    CallClock() : nsPerTick(1.0)
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        uint64_t ticks = Ticks();
+        this_thread::sleep_for(chrono::milliseconds(20));
+        ticks = Ticks() - ticks;
+        nsPerTick = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / ticks;
+#endif
+    }
+public:
+    static CallClock& Instance()
+    {
+        static CallClock instance;
+        return instance;
+    }
+    static uint64_t Ticks()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+    }
+    double NsPerTick() { return nsPerTick; }
+};
+
+// HDR style latency histogram in nanoseconds: exact below 16 ns, above that 16 buckets
+// per power of two, so a bucket is at most 1/16 of its value wide. Values are capped at 2^37 - 1 ns.
+// One thread records, any thread may read, so the counters need no atomic adds.
+class LatencyHistogram
+{
+public:
+    enum { SubBuckets = 16, MaxShift = 32, Buckets = (MaxShift + 2) * SubBuckets };
+private:
+    atomic<uint64_t> counts[Buckets];
+    atomic<uint64_t> samples, sum, maxNs;
+    static void Bump(atomic<uint64_t> &a, uint64_t by)
+    { a.store(a.load(memory_order_relaxed) + by, memory_order_relaxed); }
+public:
+    LatencyHistogram() : samples(0), sum(0), maxNs(0)
+    { for (int i = 0; i < Buckets; i++) { counts[i].store(0, memory_order_relaxed); } }
+    static int Index(uint64_t ns)
+    {
+        if (ns < SubBuckets) { return (int)ns; }
+        ns = min(ns, ((uint64_t)2 << (MaxShift + 4)) - 1);
+        int shift = 63 - __builtin_clzll(ns) - 4;
+        return (shift + 1) * SubBuckets + (int)((ns >> shift) - SubBuckets);
+    }
+    // Smallest and largest value of a bucket
+    static uint64_t Low(int i)
+    { return (i < SubBuckets) ? i : (uint64_t)(SubBuckets + i % SubBuckets) << (i / SubBuckets - 1); }
+    static uint64_t High(int i)
+    { return (i < SubBuckets) ? i : Low(i) + ((uint64_t)1 << (i / SubBuckets - 1)) - 1; }
+    // Only called by the owning thread
+    void Record(uint64_t ns)
+    {
+        Bump(counts[Index(ns)], 1);
+        Bump(samples, 1);
+        Bump(sum, ns);
+        if (ns > maxNs.load(memory_order_relaxed)) { maxNs.store(ns, memory_order_relaxed); }
+    }
+    static void Count(atomic<uint64_t> &a) { Bump(a, 1); }
+    friend class LatencySummary;
+};
+
+// Histograms of all threads merged together, taken when someone reads the statistics
+// "calls" counts every call, the latencies come from the "samples" that were timed
+class LatencySummary
+{
+public:
+    vector<uint64_t> counts;
+    uint64_t calls, samples, sum, maxNs;
+    LatencySummary() : counts(LatencyHistogram::Buckets), calls(0), samples(0), sum(0), maxNs(0) { }
+    void Merge(uint64_t c, const LatencyHistogram &h)
+    {
+        calls += c;
+        for (int i = 0; i < LatencyHistogram::Buckets; i++) { counts[i] += h.counts[i].load(memory_order_relaxed); }
+        samples += h.samples.load(memory_order_relaxed);
+        sum += h.sum.load(memory_order_relaxed);
+        maxNs = max(maxNs, h.maxNs.load(memory_order_relaxed));
+    }
+    double Mean() { return samples ? (double)sum / samples : 0; }
+    // Value at or below which "p" percent of the samples are, as the top of its bucket
+    uint64_t Percentile(double p)
+    {
+        uint64_t want = (uint64_t)ceil(samples * p / 100.0), seen = 0;
+        for (int i = 0; i < LatencyHistogram::Buckets; i++)
+        {
+            seen += counts[i];
+            if (seen >= want && seen > 0) { return min(LatencyHistogram::High(i), maxNs); }
+        }
+        return maxNs;
+    }
+};
+
+// The instrumenting proxy, counts the calls of each method and how long the server took
+// Every thread records into histograms of its own, found through a thread local cache,
+// so recording is a few plain stores. Reading merges all threads.
+// Every call is counted, one in "sampleEvery" is timed: a pair of time stamps costs far more
+// than a cheap server call (two RDTSC are ~50 ns on some VMs), sampleEvery = 1 times them all.
+class InstrumentingMathProxy : public IMath
+{
+public:
+    enum Method { MAdd, MSub, MMul, MDev, MAddN, MSubN, MMulN, MDevN, Methods };
+private:
+    struct ThreadStats
+    {
+        alignas(64) atomic<uint64_t> calls[Methods];
+        uint32_t untilSample;
+        LatencyHistogram hist[Methods];
+        ThreadStats() : untilSample(1)
+        { for (int m = 0; m < Methods; m++) { calls[m].store(0, memory_order_relaxed); } }
+    };
+    // Which ThreadStats this thread uses for which proxy, proxies are told apart by an id never reused
+    struct LocalEntry
+    {
+        uint64_t proxy;
+        ThreadStats *stats;
+    };
+    IMath *math;
+    uint64_t id;
+    double nsPerTick;
+    uint32_t sampleEvery;
+    mutex lock;
+    vector<ThreadStats*> threads;
+
+    static uint64_t NewId()
+    {
+        static atomic<uint64_t> next(1);
+        return next++;
+    }
+    // Ids of the proxies not destroyed yet, so threads can forget the others
+    static mutex &LiveLock()
+    {
+        static mutex m;
+        return m;
+    }
+    static unordered_set<uint64_t> &Live()
+    {
+        static unordered_set<uint64_t> ids;
+        return ids;
+    }
+    ThreadStats *Local()
+    {
+        static thread_local LocalEntry last = { 0, NULL };
+        if (last.proxy == id) { return last.stats; }
+        return Register(last);
+    }
+    // First call of this thread through this proxy, or it switched between proxies
+    ThreadStats *Register(LocalEntry &last)
+    {
+        static thread_local vector<LocalEntry> all;
+        for (size_t i = 0; i < all.size(); i++)
+        {
+            if (all[i].proxy == id) { last = all[i]; return last.stats; }
+        }
+        // A new proxy for this thread, drop the entries of destroyed ones first
+        {
+            lock_guard<mutex> guard(LiveLock());
+            size_t n = 0;
+            for (size_t i = 0; i < all.size(); i++)
+            { if (Live().count(all[i].proxy)) { all[n++] = all[i]; } }
+            all.resize(n);
+        }
+        ThreadStats *stats = new ThreadStats();
+        {
+            lock_guard<mutex> guard(lock);
+            threads.push_back(stats);
+        }
+        LocalEntry e = { id, stats };
+        all.push_back(e);
+        last = e;
+        return stats;
+    }
+    // Count the call, true if this one is timed
+    bool Sample(ThreadStats *s, Method m)
+    {
+        LatencyHistogram::Count(s->calls[m]);
+        if (--s->untilSample != 0) { return false; }
+        s->untilSample = sampleEvery;
+        return true;
+    }
+    double Element(Method m, double (IMath::*f)(double, double), double x, double y)
+    {
+        ThreadStats *s = Local();
+        if (!Sample(s, m)) { return (math->*f)(x, y); }
+        uint64_t start = CallClock::Ticks();
+        double r = (math->*f)(x, y);
+        s->hist[m].Record((uint64_t)((CallClock::Ticks() - start) * nsPerTick));
+        return r;
+    }
+    void Array(Method m, void (IMath::*f)(const double*, const double*, double*, size_t),
+               const double *x, const double *y, double *out, size_t n)
+    {
+        ThreadStats *s = Local();
+        if (!Sample(s, m)) { (math->*f)(x, y, out, n); return; }
+        uint64_t start = CallClock::Ticks();
+        (math->*f)(x, y, out, n);
+        s->hist[m].Record((uint64_t)((CallClock::Ticks() - start) * nsPerTick));
+    }
+public:
+    InstrumentingMathProxy(IMath *server, uint32_t sample = 64)
+        : math(server), id(NewId()), nsPerTick(CallClock::Instance().NsPerTick()), sampleEvery(max(sample, 1u))
+    {
+        lock_guard<mutex> guard(LiveLock());
+        Live().insert(id);
+    }
+    ~InstrumentingMathProxy()
+    {
+        {
+            lock_guard<mutex> guard(LiveLock());
+            Live().erase(id);
+        }
+        for (size_t i = 0; i < threads.size(); i++) { delete threads[i]; }
+    }
+    // Implement the interface
+    double Add(double x,double y) { return Element(MAdd, &IMath::Add, x, y); }
+    double Sub(double x,double y) { return Element(MSub, &IMath::Sub, x, y); }
+    double Mul(double x,double y) { return Element(MMul, &IMath::Mul, x, y); }
+    double Dev(double x,double y) { return Element(MDev, &IMath::Dev, x, y); }
+    void AddN(const double *x, const double *y, double *out, size_t n) { Array(MAddN, &IMath::AddN, x, y, out, n); }
+    void SubN(const double *x, const double *y, double *out, size_t n) { Array(MSubN, &IMath::SubN, x, y, out, n); }
+    void MulN(const double *x, const double *y, double *out, size_t n) { Array(MMulN, &IMath::MulN, x, y, out, n); }
+    void DevN(const double *x, const double *y, double *out, size_t n) { Array(MDevN, &IMath::DevN, x, y, out, n); }
+
+    static const char *Name(int m)
+    {
+        static const char *names[] = { "Add", "Sub", "Mul", "Dev", "AddN", "SubN", "MulN", "DevN" };
+        return names[m];
+    }
+    // Statistics of one method over all threads
+    LatencySummary Summary(Method m)
+    {
+        LatencySummary s;
+        lock_guard<mutex> guard(lock);
+        for (size_t i = 0; i < threads.size(); i++)
+        { s.Merge(threads[i]->calls[m].load(memory_order_relaxed), threads[i]->hist[m]); }
+        return s;
+    }
+    // One line per method that was called
+    void DumpText(ostream &os)
+    {
+        for (int m = 0; m < Methods; m++)
+        {
+            LatencySummary s = Summary((Method)m);
+            if (s.calls == 0) { continue; }
+            os << Name(m) << ": " << s.calls << " calls, " << s.samples << " timed, mean " << s.Mean() << " ns, p50 " << s.Percentile(50)
+               << " ns, p90 " << s.Percentile(90) << " ns, p99 " << s.Percentile(99) << " ns, p99.9 "
+               << s.Percentile(99.9) << " ns, max " << s.maxNs << " ns" << endl;
+        }
+    }
+    // Every method with its non empty buckets as [low, high, count]
+    void DumpJson(ostream &os)
+    {
+        os << "{\"methods\":{";
+        for (int m = 0; m < Methods; m++)
+        {
+            LatencySummary s = Summary((Method)m);
+            os << (m ? "," : "") << "\"" << Name(m) << "\":{\"calls\":" << s.calls << ",\"timed\":" << s.samples << ",\"mean_ns\":" << s.Mean()
+               << ",\"p50_ns\":" << s.Percentile(50) << ",\"p90_ns\":" << s.Percentile(90)
+               << ",\"p99_ns\":" << s.Percentile(99) << ",\"p999_ns\":" << s.Percentile(99.9)
+               << ",\"max_ns\":" << s.maxNs << ",\"buckets\":[";
+            bool first = true;
+            for (int i = 0; i < LatencyHistogram::Buckets; i++)
+            {
+                if (s.counts[i] == 0) { continue; }
+                os << (first ? "" : ",") << "[" << LatencyHistogram::Low(i) << "," << LatencyHistogram::High(i)
+                   << "," << s.counts[i] << "]";
+                first = false;
+            }
+            os << "]}";
+        }
+        os << "}}" << endl;
+    }
+};
+
+// Cost of the instrumenting proxy over the server it wraps, per call
+// Timing one call in 64 (the default) and timing every call, which costs two time stamps
+void BenchInstrument(size_t calls)
+{
+    cout << "Instrumenting proxy benchmark: " << calls << " calls" << endl;
+    IMath * volatile server = new Math();
+    uint32_t samples[] = { 64, 1 };
+    for (int threads = 1; threads <= 4; threads *= 4)
+    {
+        double directNs = TimeCalls(server, threads, calls, 0);
+        cout << "  " << threads << " threads: server " << directNs << " ns/call";
+        for (int k = 0; k < 2; k++)
+        {
+            InstrumentingMathProxy *proxy = new InstrumentingMathProxy(server, samples[k]);
+            IMath * volatile instrumented = proxy;
+            double proxyNs = TimeCalls(instrumented, threads, calls, 0);
+            cout << ", timing 1 in " << samples[k] << " " << proxyNs << " ns/call (+" << (proxyNs - directNs) << ")";
+            delete proxy;
+        }
+        cout << endl;
+    }
+    delete server;
+}
+
+// Element throughput of the per element virtual calls and the array interface
+// Arrays from 1K to "maxN" elements, each size runs about 200M elements in total
+void BenchBatch(size_t maxN)
+{
+    cout << "Batch benchmark: AddN vs Add per element, best kernels here: " << MathKernels::Instance().Name() << endl;
+    vector<double> x(maxN), y(maxN), out(maxN);
+    for (size_t i = 0; i < maxN; i++) { x[i] = i * 0.5; y[i] = 3.0 + (i & 7); }
+    // Through a volatile pointer, so the compiler can't see the type and skip the virtual calls
+    IMath * volatile server = new Math();
+    IMath *math = server;
+    const char *sets[] = { "scalar", "sse2", "avx2" };
+    for (size_t n = 1000; n <= maxN; n *= 10)
+    {
+        size_t rounds = max((size_t)1, (size_t)200000000 / n);
+        cout << "  " << n << " elements:";
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        for (size_t r = 0; r < rounds; r++)
+        { for (size_t i = 0; i < n; i++) { out[i] = math->Add(x[i], y[i]); } }
+        double sec = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout << " per call " << (size_t)(n * rounds / sec / 1e6) << " M/s";
+        for (int k = 0; k < 3; k++)
+        {
+            if (!MathKernels::Instance().Select(sets[k])) { continue; }
+            start = chrono::steady_clock::now();
+            for (size_t r = 0; r < rounds; r++)
+            { math->AddN(x.data(), y.data(), out.data(), n); }
+            sec = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            cout << ", " << sets[k] << " " << (size_t)(n * rounds / sec / 1e6) << " M/s";
+        }
+        cout << endl;
+    }
+    MathKernels::Instance().Select("");
+    delete math;
+}
+
 // Test Proxy pattern
-int main()
+// Run "main bench [cache|batch [max elements]|remote|instrument]" for the benchmarks
+// Run "main server <socket path>" to serve Math to remote proxies
+int main(int argc, char *argv[])
 {
+    if (argc > 2 && string(argv[1]) == "server")
+    {
+        Math server;
+        MathServer(argv[2], &server).Run(0);
+        return 0;
+    }
+    if (argc > 1 && string(argv[1]) == "bench")
+    {
+        string which = (argc > 2) ? argv[2] : "";
+        if (which == "" || which == "cache")
+        { BenchCache(2000000); }
+        if (which == "" || which == "batch")
+        { BenchBatch((argc > 3) ? atol(argv[3]) : 100000000); }
+        if (which == "" || which == "remote")
+        { BenchRemote(1000000); }
+        if (which == "" || which == "instrument")
+        { BenchInstrument(50000000); }
+        return 0;
+    }
+
     // Use original server to do operation
     IMath *math = new Math();
     cout << math->Add(2,3) << endl;
@@ -71,6 +1202,38 @@ int main()
     cout << pmath->Mul(2,3) << endl;
     cout << pmath->Dev(2,3) << endl;
 
+    // Work on whole arrays, the proxy adds 100 to each result as well
+    double xs[] = { 1, 2, 3, 4, 5 }, ys[] = { 5, 4, 3, 2, 1 }, rs[5];
+    pmath->MulN(xs, ys, rs, 5);
+    for (int i = 0; i < 5; i++) { cout << rs[i] << " "; }
+    cout << endl;
+
+    // Use caching proxy, the second call is answered from the cache
+    CachingMathProxy *cmath = new CachingMathProxy(math, 1024, new LruPolicy());
+    cout << cmath->Mul(2,3) << endl;
+    cout << cmath->Mul(2,3) << endl;
+    CacheStats st = cmath->Stats();
+    cout << st.hits << " hits, " << st.misses << " misses" << endl;
+
+    // Use remote proxy, the server runs in a child process
+    string path = "/tmp/imath-demo-" + to_string(getpid()) + ".sock";
+    pid_t server = StartMathServer(path, 1);
+    {
+        RemoteMathProxy remote(path);
+        cout << remote.Add(2,3) << endl;
+        remote.AddN(xs, ys, rs, 5);
+        for (int i = 0; i < 5; i++) { cout << rs[i] << " "; }
+        cout << endl;
+    }
+    waitpid(server, NULL, 0);
+
+    // Use instrumenting proxy, then see what the calls cost
+    InstrumentingMathProxy *imath = new InstrumentingMathProxy(math, 1);
+    for (int i = 0; i < 1000; i++) { imath->Add(i, 3); }
+    imath->AddN(xs, ys, rs, 5);
+    imath->DumpText(cout);
+    imath->DumpJson(cout);
+
     // The end
     return 0;
 }
@@ -11,26 +11,214 @@
 
 #include <iostream>
 #include <string>
+#include <vector>
+#include <chrono>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
 using namespace std;
 
-// The operation outlet
-class DataAccessObject
+// Just a function, for convenient
+string SqlResult(string sql, string connectionString)
+{ return (string("Result of '") + sql + string("'")); }
+
+// A query whose SQL is built once, and which a connection prepares once
+class Query
+{
+private:
+    static int NextId()
+    {
+        static atomic<int> next(0);
+        return next++;
+    }
+public:
+    const int id;
+    const string sql;
+    Query(const string &text) : id(NextId()), sql(text) { }
+};
+
+// Latency of the simulated data source, in microseconds
+struct DataSourceLatency
+{
+    int connect, prepare, execute;
+};
+
+// Part of a result set, rows come in batches
+typedef vector<string> RowBatch;
+
+class Connection;
+
+// A local stand in for the database server
+// Streamed queries read "rows" rows of a synthetic table
+// Each step burns its latency on the calling thread, so runs are timed precisely
+class DataSource
+{
+private:
+    DataSourceLatency latency;
+    DataSource() : rows(10) { SetLatency(0, 0, 0); }
+public:
+    atomic<int> opened, prepared, executed;
+    size_t rows;
+    static DataSource& Instance()
+    {
+        static DataSource instance;
+        return instance;
+    }
+    void SetLatency(int connectUs, int prepareUs, int executeUs)
+    {
+        DataSourceLatency l = { connectUs, prepareUs, executeUs };
+        latency = l;
+        opened = prepared = executed = 0;
+    }
+    static void Spend(int us)
+    {
+        if (us <= 0) { return; }
+        chrono::steady_clock::time_point end = chrono::steady_clock::now() + chrono::microseconds(us);
+        while (chrono::steady_clock::now() < end) { }
+    }
+    Connection *Open(const string &connectionString);
+    void Prepare(const string &) { Spend(latency.prepare); prepared++; }
+    string Execute(const string &sql, const string &connectionString)
+    {
+        Spend(latency.execute);
+        executed++;
+        return SqlResult(sql, connectionString);
+    }
+};
+
+// An open connection, it remembers which queries are prepared on it
+class Connection
+{
+private:
+    DataSource *source;
+    string connectionString;
+    vector<bool> prepared;
+public:
+    Connection(DataSource *s, const string &cs) : source(s), connectionString(cs) { }
+    string Execute(const Query &query)
+    {
+        if (query.id >= (int)prepared.size()) { prepared.resize(query.id + 1, false); }
+        if (!prepared[query.id])
+        {
+            source->Prepare(query.sql);
+            prepared[query.id] = true;
+        }
+        return source->Execute(query.sql, connectionString);
+    }
+    // Rows of the synthetic table, handed to "sink" "batchRows" at a time
+    // The sink returns false to stop early
+    template <class Sink>
+    void ExecuteRows(const Query &query, size_t batchRows, Sink sink)
+    {
+        Execute(query);
+        RowBatch batch;
+        for (size_t i = 0; i < source->rows; i++)
+        {
+            batch.push_back("ProductName " + to_string(i));
+            if (batch.size() == batchRows)
+            {
+                if (!sink(batch)) { return; }
+                batch.clear();
+            }
+        }
+        if (!batch.empty()) { sink(batch); }
+    }
+};
+
+Connection *DataSource::Open(const string &connectionString)
+{
+    Spend(latency.connect);
+    opened++;
+    return new Connection(this, connectionString);
+}
+
+// Open connections kept for reuse, a run takes one and gives it back
+// Connections and the queries prepared on them outlive the runs
+class ConnectionPool
+{
+private:
+    DataSource *source;
+    string connectionString;
+    size_t maxIdle;
+    mutex lock;
+    vector<Connection*> idle;
+public:
+    ConnectionPool(DataSource *s, const string &cs, size_t idleLimit = 16)
+        : source(s), connectionString(cs), maxIdle(idleLimit) { }
+    ~ConnectionPool()
+    { for (size_t i = 0; i < idle.size(); i++) { delete idle[i]; } }
+    Connection *Acquire()
+    {
+        {
+            lock_guard<mutex> guard(lock);
+            if (!idle.empty())
+            {
+                Connection *c = idle.back();
+                idle.pop_back();
+                return c;
+            }
+        }
+        return source->Open(connectionString);
+    }
+    void Release(Connection *c)
+    {
+        {
+            lock_guard<mutex> guard(lock);
+            if (idle.size() < maxIdle) { idle.push_back(c); return; }
+        }
+        delete c;
+    }
+};
+
+// What every data access object has, shared by the virtual and the compile time outlets
+class DataAccessState
 {
 protected:
     string connectionString;
     string dataSet;
+    Connection *connection;
+    ConnectionPool *pool;
+
+    // The default connect and disconnect steps
+    // With a pool the connection is borrowed, without one it's opened for this run only
+    void DefaultConnect()
+    {
+        if (pool) { connection = pool->Acquire(); return; }
+        connectionString = "Server=.;User Id=sa;Password=;Database=Northwind";
+        connection = DataSource::Instance().Open(connectionString);
+    }
+    void DefaultDisconnect()
+    {
+        if (pool) { pool->Release(connection); }
+        else { delete connection; }
+        connection = NULL;
+        connectionString = "";
+    }
+    DataAccessState(ConnectionPool *p) : connection(NULL), pool(p) { }
+};
 
+// The operation outlet
+class DataAccessObject : protected DataAccessState
+{
+protected:
     // Default implementation, can be override in sub-classes
-    virtual void Connect()
-    { connectionString = "Server=.;User Id=sa;Password=;Database=Northwind"; }
-    virtual void Disconnect()
-    { connectionString = ""; }
+    virtual void Connect() { DefaultConnect(); }
+    virtual void Disconnect() { DefaultDisconnect(); }
 
     // The implementation of this two steps are delay to sub-classes
     virtual void Select() = 0;
     virtual void Display() = 0;
 
 public:
+    DataAccessObject(ConnectionPool *p = NULL) : DataAccessState(p) { }
+    virtual ~DataAccessObject() { }
+
     // The "Template Method" 
     void Run()
     {
@@ -41,10 +229,6 @@ public:
     }
 };
 
-// Just a function, for convenient
-string SqlResult(string sql, string connectionString)
-{ return (string("Result of '") + sql + string("'")); }
-
 // A sub-class of the templated operation
 class Categories : public DataAccessObject
 {
@@ -52,14 +236,16 @@ protected:
     // Implement the missing steps (protected interface)
     void Select()
     {
-        string sql = "select CategoryName from Categories";
-        dataSet = SqlResult(sql, connectionString);
+        static const Query query("select CategoryName from Categories");
+        dataSet = connection->Execute(query);
     }
     void Display()
     {
         cout << "Categories ---- " << endl;
         cout << dataSet << endl;
     }
+public:
+    Categories(ConnectionPool *p = NULL) : DataAccessObject(p) { }
 };
 
 // Another sub-class of the templated operation
@@ -69,19 +255,356 @@ protected:
     // Implement the missing steps (protected interface)
     void Select()
     {
-        string sql = "select top 10 ProductName from Products";
-        dataSet = SqlResult(sql, connectionString);
+        static const Query query("select top 10 ProductName from Products");
+        dataSet = connection->Execute(query);
     }
     void Display()
     {
         cout << "Products ---- " << endl;
         cout << dataSet << endl;
     }
+public:
+    Products(ConnectionPool *p = NULL) : DataAccessObject(p) { }
+};
+
+// Bounded queue of row batches between a producer and a consumer thread
+// Push waits while the queue is full, so memory stays at "capacity" batches
+class RowQueue
+{
+private:
+    size_t capacity;
+    bool closed;
+    deque<RowBatch> batches;
+    mutex lock;
+    condition_variable notFull, notEmpty;
+public:
+    RowQueue(size_t cap) : capacity(cap), closed(false) { }
+    void Reset() { batches.clear(); closed = false; }
+    // False once the queue is closed, the batch is then dropped
+    bool Push(RowBatch &batch)
+    {
+        unique_lock<mutex> guard(lock);
+        notFull.wait(guard, [this] { return batches.size() < capacity || closed; });
+        if (closed) { return false; }
+        batches.push_back(RowBatch());
+        batches.back().swap(batch);
+        notEmpty.notify_one();
+        return true;
+    }
+    // No more batches will come, or none are wanted any more
+    void Close()
+    {
+        lock_guard<mutex> guard(lock);
+        closed = true;
+        notEmpty.notify_all();
+        notFull.notify_all();
+    }
+    // False once the queue is closed and empty
+    bool Pop(RowBatch &batch)
+    {
+        unique_lock<mutex> guard(lock);
+        notEmpty.wait(guard, [this] { return !batches.empty() || closed; });
+        if (batches.empty()) { return false; }
+        batch.swap(batches.front());
+        batches.pop_front();
+        notFull.notify_one();
+        return true;
+    }
 };
 
+// The streaming operation outlet, same "Template Method" with streaming Select and Display
+// Select starts Fetch on a thread of its own, it pushes row batches into a bounded queue,
+// while Display shows them as they arrive. The result set is never held as a whole.
+class StreamingDataAccessObject : public DataAccessObject
+{
+private:
+    RowQueue rows;
+    thread producer;
+    exception_ptr error;
+protected:
+    // The steps of the streaming sub-classes
+    virtual void Fetch(RowQueue &rows) = 0;
+    virtual void Show(const RowBatch &batch) = 0;
+    // Hook before the first batch, does nothing by default
+    virtual void BeginDisplay() { }
+
+    void Select()
+    {
+        rows.Reset();
+        error = NULL;
+        producer = thread([this]() {
+            try { Fetch(rows); }
+            catch (...) { error = current_exception(); }
+            rows.Close();
+        });
+    }
+    void Display()
+    {
+        try
+        {
+            BeginDisplay();
+            RowBatch batch;
+            while (rows.Pop(batch)) { Show(batch); }
+        }
+        catch (...)
+        {
+            // The producer may wait on a full queue, close it to let the thread end
+            Stop();
+            throw;
+        }
+        producer.join();
+        if (error) { rethrow_exception(error); }
+    }
+    void Stop()
+    {
+        rows.Close();
+        if (producer.joinable()) { producer.join(); }
+    }
+public:
+    StreamingDataAccessObject(ConnectionPool *p = NULL, size_t queuedBatches = 8)
+        : DataAccessObject(p), rows(queuedBatches) { }
+    ~StreamingDataAccessObject() { Stop(); }
+};
+
+// A streaming sub-class, products come in batches of 4096 rows
+class StreamingProducts : public StreamingDataAccessObject
+{
+protected:
+    void Fetch(RowQueue &rows)
+    {
+        static const Query query("select ProductName from Products");
+        connection->ExecuteRows(query, 4096, [&rows](RowBatch &batch) { return rows.Push(batch); });
+    }
+    void BeginDisplay()
+    { cout << "Products ---- " << endl; }
+    void Show(const RowBatch &batch)
+    { for (size_t i = 0; i < batch.size(); i++) { cout << batch[i] << '\n'; } }
+public:
+    StreamingProducts(ConnectionPool *p = NULL) : StreamingDataAccessObject(p) { }
+};
+
+// The compile time operation outlet, the "Template Method" bound to the sub-class with CRTP
+// No step is virtual, so small steps inline into Run. A sub-class must have Select and Display,
+// its own Connect or Disconnect hides the default one. Steps are reached through friendship.
+template <class Derived>
+class DataAccessObjectT : protected DataAccessState
+{
+protected:
+    // Default implementation, can be hidden in sub-classes
+    void Connect() { DefaultConnect(); }
+    void Disconnect() { DefaultDisconnect(); }
+
+public:
+    DataAccessObjectT(ConnectionPool *p = NULL) : DataAccessState(p) { }
+
+    // The "Template Method"
+    void Run()
+    {
+        Derived &self = static_cast<Derived&>(*this);
+        self.Connect();
+        self.Select();
+        self.Display();
+        self.Disconnect();
+    }
+};
+
+// The sub-classes again, with the steps bound at compile time
+class CategoriesT : public DataAccessObjectT<CategoriesT>
+{
+    friend class DataAccessObjectT<CategoriesT>;
+protected:
+    void Select()
+    {
+        static const Query query("select CategoryName from Categories");
+        dataSet = connection->Execute(query);
+    }
+    void Display()
+    {
+        cout << "Categories ---- " << endl;
+        cout << dataSet << endl;
+    }
+public:
+    CategoriesT(ConnectionPool *p = NULL) : DataAccessObjectT<CategoriesT>(p) { }
+};
+
+class ProductsT : public DataAccessObjectT<ProductsT>
+{
+    friend class DataAccessObjectT<ProductsT>;
+protected:
+    void Select()
+    {
+        static const Query query("select top 10 ProductName from Products");
+        dataSet = connection->Execute(query);
+    }
+    void Display()
+    {
+        cout << "Products ---- " << endl;
+        cout << dataSet << endl;
+    }
+public:
+    ProductsT(ConnectionPool *p = NULL) : DataAccessObjectT<ProductsT>(p) { }
+};
+
+// Output stream which throws everything away, keeps the benchmark off the terminal
+class NullBuffer : public streambuf
+{
+protected:
+    int overflow(int c) { return c; }
+};
+
+// Runs per second with a connection opened per run, and with pooled connections
+// The data source takes 200 us to connect, 30 us to prepare and 20 us to execute a query
+void BenchPool(int runs)
+{
+    DataSource &source = DataSource::Instance();
+    cout << "Pool benchmark: " << runs << " runs, connect 200 us, prepare 30 us, execute 20 us" << endl;
+    NullBuffer nullBuffer;
+    for (int pooled = 0; pooled < 2; pooled++)
+    {
+        source.SetLatency(200, 30, 20);
+        ConnectionPool pool(&source, "Server=.;User Id=sa;Password=;Database=Northwind");
+        DataAccessObject *dao = new Products(pooled ? &pool : NULL);
+        streambuf *old = cout.rdbuf(&nullBuffer);
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        for (int i = 0; i < runs; i++) { dao->Run(); }
+        double sec = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout.rdbuf(old);
+        cout << "  " << (pooled ? "pooled and prepared" : "connect per run") << ": " << (int)(runs / sec)
+             << " runs/s, " << source.opened << " connects, " << source.prepared << " prepares" << endl;
+        delete dao;
+    }
+    source.SetLatency(0, 0, 0);
+}
+
+// The old way for large results, all rows are gathered in dataSet before Display
+class BufferedProducts : public DataAccessObject
+{
+protected:
+    void Select()
+    {
+        static const Query query("select ProductName from Products");
+        dataSet.clear();
+        connection->ExecuteRows(query, 4096, [this](RowBatch &batch) {
+            for (size_t i = 0; i < batch.size(); i++) { dataSet += batch[i]; dataSet += '\n'; }
+            return true;
+        });
+    }
+    void Display()
+    {
+        cout << "Products ---- " << endl;
+        cout << dataSet;
+    }
+};
+
+// Time to the first row shown, total time and peak memory of a "rows" rows query
+// Each way runs in a child process, so its peak resident size is its own
+void BenchStream(size_t rows)
+{
+    cout << "Stream benchmark: " << rows << " rows" << endl;
+    for (int streaming = 0; streaming < 2; streaming++)
+    {
+        cout.flush();
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            DataSource::Instance().rows = rows;
+            // Notes when the first character after the header line arrives
+            struct FirstRow : public NullBuffer
+            {
+                chrono::steady_clock::time_point at;
+                int lines = 0;
+                int overflow(int c)
+                {
+                    if (lines == 1) { at = chrono::steady_clock::now(); lines++; }
+                    if (c == '\n' && lines == 0) { lines++; }
+                    return c;
+                }
+            } firstRow;
+            DataAccessObject *dao = streaming ? (DataAccessObject*)new StreamingProducts() : new BufferedProducts();
+            streambuf *old = cout.rdbuf(&firstRow);
+            chrono::steady_clock::time_point start = chrono::steady_clock::now();
+            dao->Run();
+            double sec = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            cout.rdbuf(old);
+            rusage usage;
+            getrusage(RUSAGE_SELF, &usage);
+            cout << "  " << (streaming ? "streaming" : "buffered") << ": first row after "
+                 << chrono::duration<double, milli>(firstRow.at - start).count() << " ms, all rows "
+                 << sec * 1000 << " ms, peak memory " << usage.ru_maxrss / 1024 << " MB" << endl;
+            delete dao;
+            _exit(0);
+        }
+        waitpid(pid, NULL, 0);
+    }
+}
+
+// A run per row with tiny steps, as virtual and as compile time template method
+// Select makes the next row, Display adds it up
+class RowSumVirtual : public DataAccessObject
+{
+protected:
+    void Connect() { open = true; }
+    void Select() { row = row * 1103515245u + 12345u; }
+    void Display() { if (open) { sum += row >> 20; } }
+    void Disconnect() { open = false; }
+public:
+    bool open;
+    uint32_t row;
+    uint64_t sum;
+    RowSumVirtual() : open(false), row(1), sum(0) { }
+};
+
+class RowSumStatic : public DataAccessObjectT<RowSumStatic>
+{
+    friend class DataAccessObjectT<RowSumStatic>;
+protected:
+    void Connect() { open = true; }
+    void Select() { row = row * 1103515245u + 12345u; }
+    void Display() { if (open) { sum += row >> 20; } }
+    void Disconnect() { open = false; }
+public:
+    bool open;
+    uint32_t row;
+    uint64_t sum;
+    RowSumStatic() : open(false), row(1), sum(0) { }
+};
+
+// Nanoseconds per run of the per row operation, with virtual and with static dispatch
+void BenchDispatch(size_t runs)
+{
+    cout << "Dispatch benchmark: " << runs << " runs of four tiny steps" << endl;
+    // Through a volatile pointer, so the compiler can't see the type and skip the virtual calls
+    RowSumVirtual virtualRows;
+    DataAccessObject * volatile dao = &virtualRows;
+    DataAccessObject *viaBase = dao;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for (size_t i = 0; i < runs; i++) { viaBase->Run(); }
+    double virtualNs = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / runs;
+    RowSumStatic staticRows;
+    start = chrono::steady_clock::now();
+    for (size_t i = 0; i < runs; i++) { staticRows.Run(); }
+    double staticNs = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / runs;
+    cout << "  virtual steps: " << virtualNs << " ns/run" << endl;
+    cout << "  CRTP steps: " << staticNs << " ns/run" << endl;
+    cout << "  same sums: " << (virtualRows.sum == staticRows.sum ? "yes" : "NO") << endl;
+}
+
 // Test Template pattern
-int main()
+// Run "main bench [pool|stream [rows]|dispatch]" for the benchmarks
+int main(int argc, char *argv[])
 {
+    if (argc > 1 && string(argv[1]) == "bench")
+    {
+        string which = (argc > 2) ? argv[2] : "";
+        if (which == "" || which == "pool")
+        { BenchPool(10000); }
+        if (which == "" || which == "stream")
+        { BenchStream((argc > 3) ? atol(argv[3]) : 10000000); }
+        if (which == "" || which == "dispatch")
+        { BenchDispatch(200000000); }
+        return 0;
+    }
+
     // The outlet interface object
     DataAccessObject *dao;
 
@@ -95,6 +618,30 @@ int main()
     dao->Run();
     delete dao;
 
+    // Sub-classes sharing a pool, the connection is opened once
+    int opened = DataSource::Instance().opened;
+    ConnectionPool pool(&DataSource::Instance(), "Server=.;User Id=sa;Password=;Database=Northwind");
+    dao = new Categories(&pool);
+    dao->Run();
+    dao->Run();
+    delete dao;
+    dao = new Products(&pool);
+    dao->Run();
+    delete dao;
+    cout << (DataSource::Instance().opened - opened) << " connection opened for 3 pooled runs" << endl;
+
+    // Sub-classes with compile time steps, same results
+    CategoriesT categories(&pool);
+    categories.Run();
+    ProductsT products(&pool);
+    products.Run();
+
+    // Streaming sub-class, rows are shown while they are still fetched
+    DataSource::Instance().rows = 5;
+    dao = new StreamingProducts(&pool);
+    dao->Run();
+    delete dao;
+
     // The end
     return 0;
 }
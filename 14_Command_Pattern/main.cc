@@ -10,7 +10,29 @@
  */
 
 #include <iostream>
+#include <string>
 #include <vector>
+#include <deque>
+#include <unordered_map>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <type_traits>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <cerrno>
+#include <cstring>
+#include <cstdint>
+#include <stdexcept>
 using namespace std;
 
 // Target object
@@ -18,7 +40,10 @@ class Document
 {
     char* name;
 public:
-    Document(char* s) : name(s) { }
+    // Edits applied so far
+    long revision;
+    bool shown, deleted;
+    Document(char* s) : name(s), revision(0), shown(false), deleted(false) { }
     char* GetDocName() { return name; }
 };
 
@@ -28,70 +53,1120 @@ class DocumentCommand
 protected:
     // Have a target object pointer
     Document *document;
+    // Commands change the documents without showing anything while the flag is set, e.g. on replay
+    const bool *quiet;
+    bool Quiet() { return quiet && *quiet; }
 public:
-    DocumentCommand(Document *doc) : document(doc) { }
+    DocumentCommand(Document *doc, const bool *q = NULL) : document(doc), quiet(q) { }
+    virtual ~DocumentCommand() { }
+    Document *GetDocument() { return document; }
     // Command interfaces
     virtual void Execute() = 0;
     virtual void Undo() = 0;
+    // Take in "next", which comes right after this one: true if running this one already did
+    // what "next" would do. "next" is then set up for its undo without running.
+    virtual bool Absorb(DocumentCommand *) { return false; }
 };
 
 // A concrete command
 class DisplayCommand : public DocumentCommand
 {
+    // Undo goes back to what it was
+    bool wasShown;
 public:
-    DisplayCommand(Document *doc) : DocumentCommand(doc) { }
+    DisplayCommand(Document *doc, const bool *quiet = NULL) : DocumentCommand(doc, quiet), wasShown(false) { }
     // Here is how this commmand handle the target object
-    void Execute() { cout << "Display: " << document->GetDocName() << endl; } 
-    void Undo() { cout << "Hide doc: " << document->GetDocName() << endl; }
+    void Execute()
+    {
+        if (!Quiet()) { cout << "Display: " << document->GetDocName() << endl; }
+        wasShown = document->shown;
+        document->shown = true;
+    }
+    void Undo()
+    {
+        if (!Quiet()) { cout << "Hide doc: " << document->GetDocName() << endl; }
+        document->shown = wasShown;
+    }
+    // Showing a shown document again changes nothing
+    bool Absorb(DocumentCommand *next)
+    {
+        DisplayCommand *again = dynamic_cast<DisplayCommand*>(next);
+        if (!again || again == this || again->document != document) { return false; }
+        again->wasShown = true;
+        return true;
+    }
 };
 
 // Another concrete command
 class DeleteCommand : public DocumentCommand
 { 
+    bool wasDeleted;
 public:
-    DeleteCommand(Document *doc) : DocumentCommand(doc) { }
+    DeleteCommand(Document *doc, const bool *quiet = NULL) : DocumentCommand(doc, quiet), wasDeleted(false) { }
     // Here is how this commmand handle the target object
-    void Execute() { cout << "Delete: " << document->GetDocName() << endl; } 
-    void Undo() { cout << "Restore doc: " << document->GetDocName() << endl; }
+    void Execute()
+    {
+        if (!Quiet()) { cout << "Delete: " << document->GetDocName() << endl; }
+        wasDeleted = document->deleted;
+        document->deleted = true;
+    }
+    void Undo()
+    {
+        if (!Quiet()) { cout << "Restore doc: " << document->GetDocName() << endl; }
+        document->deleted = wasDeleted;
+    }
+    bool Absorb(DocumentCommand *next)
+    {
+        DeleteCommand *again = dynamic_cast<DeleteCommand*>(next);
+        if (!again || again == this || again->document != document) { return false; }
+        again->wasDeleted = true;
+        return true;
+    }
+};
+
+// A command held by value in a fixed size buffer, so keeping it needs no heap allocation
+// Any type with Execute and Undo fits, if it's no bigger than Capacity bytes
+class SmallCommand
+{
+public:
+    enum { Capacity = 40 };
+private:
+    struct Ops
+    {
+        void (*execute)(void*);
+        void (*undo)(void*);
+        void (*move)(void *from, void *to);
+        void (*destroy)(void*);
+    };
+    template <class C>
+    struct OpsOf
+    {
+        static void Execute(void *p) { static_cast<C*>(p)->Execute(); }
+        static void Undo(void *p) { static_cast<C*>(p)->Undo(); }
+        static void Move(void *from, void *to) { new (to) C(std::move(*static_cast<C*>(from))); }
+        static void Destroy(void *p) { static_cast<C*>(p)->~C(); }
+        static const Ops table;
+    };
+    const Ops *ops;
+    alignas(8) unsigned char buf[Capacity];
+public:
+    SmallCommand() : ops(NULL) { }
+    template <class C, class = typename enable_if<!is_same<typename decay<C>::type, SmallCommand>::value>::type>
+    SmallCommand(const C &cmd) : ops(&OpsOf<C>::table)
+    {
+        static_assert(sizeof(C) <= Capacity && alignof(C) <= 8, "command too big for SmallCommand");
+        new (buf) C(cmd);
+    }
+    SmallCommand(SmallCommand &&other) : ops(other.ops)
+    { if (ops) { ops->move(other.buf, buf); } }
+    SmallCommand &operator=(SmallCommand &&other)
+    {
+        Reset();
+        ops = other.ops;
+        if (ops) { ops->move(other.buf, buf); }
+        return *this;
+    }
+    SmallCommand(const SmallCommand&) = delete;
+    SmallCommand &operator=(const SmallCommand&) = delete;
+    ~SmallCommand() { Reset(); }
+    void Reset()
+    {
+        if (ops) { ops->destroy(buf); }
+        ops = NULL;
+    }
+    void Execute() { ops->execute(buf); }
+    void Undo() { ops->undo(buf); }
+};
+
+template <class C>
+const typename SmallCommand::Ops SmallCommand::OpsOf<C>::table =
+    { &OpsOf<C>::Execute, &OpsOf<C>::Undo, &OpsOf<C>::Move, &OpsOf<C>::Destroy };
+
+// Lets a command given by pointer live in the history, the caller still owns it
+struct CommandRef
+{
+    DocumentCommand *cmd;
+    void Execute() { cmd->Execute(); }
+    void Undo() { cmd->Undo(); }
+};
+
+// Undo and redo history in a ring buffer of "depth" commands
+// Entries before "done" can be undone, the ones after it redone. A new command drops
+// the redo entries, and once the ring is full the oldest command drops out.
+class CommandHistory
+{
+private:
+    vector<SmallCommand> ring;
+    size_t first, count, done;
+    // first and i are both below the ring size, so one wrap is enough
+    SmallCommand &At(size_t i)
+    {
+        size_t at = first + i;
+        return ring[(at >= ring.size()) ? at - ring.size() : at];
+    }
+public:
+    CommandHistory(size_t depth) : ring(max(depth, (size_t)1)), first(0), count(0), done(0) { }
+    // Depth which keeps the history within "bytes"
+    static size_t DepthForBytes(size_t bytes) { return max(bytes / sizeof(SmallCommand), (size_t)1); }
+    size_t Bytes() { return ring.size() * sizeof(SmallCommand); }
+    size_t UndoCount() { return done; }
+    size_t RedoCount() { return count - done; }
+    // Add a new command, return where it is kept
+    SmallCommand &Push(SmallCommand &&cmd)
+    {
+        while (count > done) { At(--count).Reset(); }
+        if (count == ring.size())
+        {
+            At(0).Reset();
+            first = (first + 1 == ring.size()) ? 0 : first + 1;
+            count--;
+            done--;
+        }
+        SmallCommand &slot = At(count++);
+        slot = std::move(cmd);
+        done = count;
+        return slot;
+    }
+    bool Undo()
+    {
+        if (done == 0) { return false; }
+        At(--done).Undo();
+        return true;
+    }
+    bool Redo()
+    {
+        if (done == count) { return false; }
+        At(done++).Execute();
+        return true;
+    }
+    // Move the last "n" entries to the redo side without running their undo, for a replay
+    void Rewind(size_t n) { done -= min(n, done); }
+    // The k-th command which an undo would undo, and which a redo would run
+    SmallCommand &Undoable(size_t k) { return At(done - 1 - k); }
+    SmallCommand &Redoable(size_t k) { return At(done + k); }
 };
 
 // Maintaining all commands
 class DocumentInvoker
 {
-    // To recode the command order
-    vector<DocumentCommand*> undoQueue;
+    // To recode the command order, only the last "depth" commands are kept
+    CommandHistory history;
+public:
+    DocumentInvoker(size_t depth = 1024) : history(depth) { }
+    void Execute(DocumentCommand *cmd)
+    {
+        CommandRef ref = { cmd };
+        history.Push(SmallCommand(ref)).Execute();
+    }
+    // Keep a copy of the command, without any heap allocation
+    template <class C, class = typename enable_if<!is_pointer<C>::value>::type>
+    void Execute(const C &cmd)
+    { history.Push(SmallCommand(cmd)).Execute(); }
+    void Undo() { history.Undo(); }
+    void Redo() { history.Redo(); }
+    size_t HistoryBytes() { return history.Bytes(); }
+};
+
+// Invoker which holds commands back and runs them as a batch
+// The history is kept as if every call ran at once, but what actually runs is coalesced:
+//   a command and its undo right after it cancel out, so do an undo and its redo,
+//   and a command absorbed by the one before it (like a second Display) doesn't run.
+// Commands must undo to the state they found, which the Display and Delete commands do.
+class BatchingDocumentInvoker
+{
+    struct Op
+    {
+        DocumentCommand *cmd;
+        bool undo;
+    };
+    size_t depth, batch;
+    deque<DocumentCommand*> undoQueue;
     vector<DocumentCommand*> redoQueue;
+    vector<Op> pending;
+    // Hold back a call, or coalesce it with the one before
+    void Add(DocumentCommand *cmd, bool undo)
+    {
+        logicalOps++;
+        if (!pending.empty())
+        {
+            Op &last = pending.back();
+            if (last.cmd == cmd && last.undo != undo) { pending.pop_back(); return; }
+            if (!undo && !last.undo && last.cmd->Absorb(cmd)) { return; }
+        }
+        Op op = { cmd, undo };
+        pending.push_back(op);
+        if (pending.size() >= batch) { Flush(); }
+    }
 public:
+    // Calls made, and commands that really ran
+    long logicalOps, executedOps;
+    BatchingDocumentInvoker(size_t historyDepth = 1024, size_t batchSize = 64)
+        : depth(historyDepth), batch(batchSize), logicalOps(0), executedOps(0) { }
+    ~BatchingDocumentInvoker() { Flush(); }
     void Execute(DocumentCommand *cmd)
     {
+        redoQueue.clear();
         undoQueue.push_back(cmd);
-        cmd->Execute();
+        if (undoQueue.size() > depth) { undoQueue.pop_front(); }
+        Add(cmd, false);
     }
     void Undo()
     {
-        if (undoQueue.size() > 0)
+        if (undoQueue.empty()) { return; }
+        DocumentCommand *cmd = undoQueue.back();
+        undoQueue.pop_back();
+        redoQueue.push_back(cmd);
+        Add(cmd, true);
+    }
+    void Redo()
+    {
+        if (redoQueue.empty()) { return; }
+        DocumentCommand *cmd = redoQueue.back();
+        redoQueue.pop_back();
+        undoQueue.push_back(cmd);
+        Add(cmd, false);
+    }
+    // Run what's held back
+    void Flush()
+    {
+        for (size_t i = 0; i < pending.size(); i++)
         {
-            DocumentCommand *cmd = *(undoQueue.end() -1);
-            cmd->Undo(); 
-            redoQueue.push_back(cmd);
-            undoQueue.pop_back();
+            if (pending[i].undo) { pending[i].cmd->Undo(); }
+            else { pending[i].cmd->Execute(); }
         }
+        executedOps += pending.size();
+        pending.clear();
+    }
+};
+
+// Multi-producer multi-consumer queue, pop waits until there is an item or the queue is closed
+template <class T>
+class BlockingQueue
+{
+private:
+    deque<T> items;
+    bool closed;
+    mutex lock;
+    condition_variable notEmpty;
+public:
+    BlockingQueue() : closed(false) { }
+    void Push(const T &item)
+    {
+        lock_guard<mutex> guard(lock);
+        items.push_back(item);
+        notEmpty.notify_one();
+    }
+    void Close()
+    {
+        lock_guard<mutex> guard(lock);
+        closed = true;
+        notEmpty.notify_all();
+    }
+    // False once the queue is closed and empty
+    bool Pop(T &item)
+    {
+        unique_lock<mutex> guard(lock);
+        notEmpty.wait(guard, [this] { return !items.empty() || closed; });
+        if (items.empty()) { return false; }
+        item = items.front();
+        items.pop_front();
+        return true;
+    }
+};
+
+// Invoker which runs the commands on a pool of worker threads
+// Every document has a strand, a queue of its commands of which one worker at a time runs,
+// so commands on one document run in the order they were given, and different documents in parallel.
+// Strands with work wait in a queue shared by the workers. Each call returns a future of the command.
+class AsyncDocumentInvoker
+{
+private:
+    struct Strand
+    {
+        mutex lock;
+        deque<packaged_task<void()> > tasks;
+        bool scheduled;
+        Strand() : scheduled(false) { }
+    };
+    // A worker keeps a strand for at most this many commands, then lets other documents go first
+    enum { StrandTurn = 64 };
+
+    unordered_map<Document*, Strand*> strands;
+    mutex strandsLock;
+    BlockingQueue<Strand*> ready;
+    vector<thread> workers;
+    // The history is kept in the order the commands were given
+    vector<DocumentCommand*> undoQueue;
+    vector<DocumentCommand*> redoQueue;
+    mutex historyLock;
+    // Commands given and not finished yet
+    long pending;
+    mutex pendingLock;
+    condition_variable idle;
+
+    Strand *StrandOf(Document *doc)
+    {
+        lock_guard<mutex> guard(strandsLock);
+        Strand *&s = strands[doc];
+        if (!s) { s = new Strand(); }
+        return s;
+    }
+    future<void> Submit(Document *doc, packaged_task<void()> task)
+    {
+        future<void> done = task.get_future();
+        {
+            lock_guard<mutex> guard(pendingLock);
+            pending++;
+        }
+        Strand *s = StrandOf(doc);
+        bool wake;
+        {
+            lock_guard<mutex> guard(s->lock);
+            s->tasks.push_back(move(task));
+            wake = !s->scheduled;
+            s->scheduled = true;
+        }
+        if (wake) { ready.Push(s); }
+        return done;
+    }
+    void Finished(long count)
+    {
+        lock_guard<mutex> guard(pendingLock);
+        pending -= count;
+        if (pending == 0) { idle.notify_all(); }
+    }
+    void Work()
+    {
+        Strand *s;
+        while (ready.Pop(s))
+        {
+            long ran = 0;
+            bool more = true;
+            while (more && ran < StrandTurn)
+            {
+                packaged_task<void()> task;
+                {
+                    lock_guard<mutex> guard(s->lock);
+                    if (s->tasks.empty()) { s->scheduled = false; more = false; break; }
+                    task = move(s->tasks.front());
+                    s->tasks.pop_front();
+                }
+                task();
+                ran++;
+            }
+            // Turn is over with work left, the strand goes to the back of the queue
+            if (more) { ready.Push(s); }
+            Finished(ran);
+        }
+    }
+public:
+    AsyncDocumentInvoker(int threads) : pending(0)
+    {
+        for (int i = 0; i < threads; i++) { workers.push_back(thread(&AsyncDocumentInvoker::Work, this)); }
+    }
+    ~AsyncDocumentInvoker()
+    {
+        Wait();
+        ready.Close();
+        for (size_t i = 0; i < workers.size(); i++) { workers[i].join(); }
+        for (unordered_map<Document*, Strand*>::iterator it = strands.begin(); it != strands.end(); ++it)
+        { delete it->second; }
+    }
+    // The history and the strand are both updated under historyLock, so with several producers
+    // on one document the commands run in the order the history has them
+    future<void> Execute(DocumentCommand *cmd)
+    {
+        lock_guard<mutex> guard(historyLock);
+        undoQueue.push_back(cmd);
+        return Submit(cmd->GetDocument(), packaged_task<void()>([cmd]() { cmd->Execute(); }));
+    }
+    // Undo and redo take the command from the history now, and run it after what's queued on its document
+    future<void> Undo()
+    {
+        lock_guard<mutex> guard(historyLock);
+        if (undoQueue.empty()) { return Completed(); }
+        DocumentCommand *cmd = undoQueue.back();
+        undoQueue.pop_back();
+        redoQueue.push_back(cmd);
+        return Submit(cmd->GetDocument(), packaged_task<void()>([cmd]() { cmd->Undo(); }));
+    }
+    future<void> Redo()
+    {
+        lock_guard<mutex> guard(historyLock);
+        if (redoQueue.empty()) { return Completed(); }
+        DocumentCommand *cmd = redoQueue.back();
+        redoQueue.pop_back();
+        undoQueue.push_back(cmd);
+        return Submit(cmd->GetDocument(), packaged_task<void()>([cmd]() { cmd->Execute(); }));
+    }
+    // Wait until every command given so far has run
+    void Wait()
+    {
+        unique_lock<mutex> guard(pendingLock);
+        idle.wait(guard, [this] { return pending == 0; });
+    }
+    static future<void> Completed()
+    {
+        promise<void> p;
+        p.set_value();
+        return p.get_future();
+    }
+};
+
+// Which command a log record is about, and what was done with it
+enum CommandType { DisplayType, DeleteType };
+enum LogAction { LogExecute, LogUndo, LogRedo };
+
+// Commands by type, for the log
+SmallCommand MakeCommand(int type, Document *doc, const bool *quiet = NULL)
+{
+    if (type == DeleteType) { return SmallCommand(DeleteCommand(doc, quiet)); }
+    return SmallCommand(DisplayCommand(doc, quiet));
+}
+
+// One record of the command log, 8 bytes in the native byte order of the host
+// Undo and redo records name the document of the command they undo or redo
+struct LogRecord
+{
+    uint32_t doc;
+    uint8_t action, type;
+    uint16_t check;
+    static uint16_t Check(uint32_t doc, uint8_t action, uint8_t type)
+    { return (uint16_t)((doc * 40503u) ^ (doc >> 16) ^ (action * 0x1f1u) ^ (type * 0x3c7u) ^ 0xa5a5u); }
+    static LogRecord Make(uint32_t doc, uint8_t action, uint8_t type)
+    {
+        LogRecord r = { doc, action, type, Check(doc, action, type) };
+        return r;
+    }
+    bool Valid(size_t documents) const
+    { return doc < documents && action <= LogRedo && type <= DeleteType && check == Check(doc, action, type); }
+};
+
+// When appended records are forced to disk
+enum SyncPolicy
+{
+    SyncEveryCommand,   // fdatasync after each record
+    SyncGroup,          // group commit, fdatasync once "group" records are buffered
+    SyncNever           // written "group" records at a time, the OS decides when they reach the disk
+};
+
+// Append only file of command records, starts with an 8 byte header
+class CommandLog
+{
+private:
+    int fd;
+    SyncPolicy policy;
+    size_t group;
+    vector<LogRecord> buffer;
+public:
+    static const char *Header() { return "CMDLOG01"; }
+    CommandLog(const string &path, SyncPolicy p, size_t groupSize = 256)
+        : policy(p), group(max(groupSize, (size_t)1))
+    {
+        fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (fd < 0) { throw runtime_error("can't open " + path); }
+        off_t size = lseek(fd, 0, SEEK_END);
+        // A header torn by a crash is written again
+        if (size > 0 && size < 8 && ftruncate(fd, 0) == 0) { size = 0; }
+        if (size == 0) { WriteAll(Header(), 8); }
+        buffer.reserve(group);
+    }
+    // A destructor can't report a failed write, call Close() to learn about it
+    ~CommandLog()
+    {
+        if (fd < 0) { return; }
+        try { Commit(); }
+        catch (...) { }
+        close(fd);
+    }
+    void Append(const LogRecord &r)
+    {
+        buffer.push_back(r);
+        if (policy == SyncEveryCommand || buffer.size() >= group) { Commit(); }
+    }
+    // Write what's buffered, and make it durable unless the policy says never
+    void Commit()
+    {
+        if (buffer.empty()) { return; }
+        WriteAll(buffer.data(), buffer.size() * sizeof(LogRecord));
+        buffer.clear();
+        if (policy != SyncNever && fdatasync(fd) != 0) { throw runtime_error("command log sync failed"); }
+    }
+    // Commit and close the file, throws if anything logged didn't make it
+    void Close()
+    {
+        if (fd < 0) { return; }
+        try { Commit(); }
+        catch (...) { close(fd); fd = -1; throw; }
+        int f = fd;
+        fd = -1;
+        if (close(f) != 0) { throw runtime_error("command log close failed"); }
+    }
+    void WriteAll(const void *data, size_t len)
+    {
+        const char *p = (const char*)data;
+        while (len > 0)
+        {
+            ssize_t n = write(fd, p, len);
+            if (n < 0 && errno == EINTR) { continue; }
+            if (n <= 0) { throw runtime_error("command log write failed"); }
+            p += n;
+            len -= n;
+        }
+    }
+};
+
+// Documents of the commands in a history of "depth", without the commands
+// The log uses it to know what an undo or redo is about
+class HistoryShape
+{
+public:
+    deque<uint32_t> undo;
+    vector<uint32_t> redo;
+    size_t depth;
+    HistoryShape(size_t d) : depth(max(d, (size_t)1)) { }
+    void Execute(uint32_t doc)
+    {
+        redo.clear();
+        undo.push_back(doc);
+        if (undo.size() > depth) { undo.pop_front(); }
+    }
+    // The document of the command undone or redone, -1 if there is none
+    long Undo()
+    {
+        if (undo.empty()) { return -1; }
+        uint32_t doc = undo.back();
+        undo.pop_back();
+        redo.push_back(doc);
+        return doc;
+    }
+    long Redo()
+    {
+        if (redo.empty()) { return -1; }
+        uint32_t doc = redo.back();
+        redo.pop_back();
+        undo.push_back(doc);
+        return doc;
+    }
+};
+
+// Invoker which survives restarts: every execute, undo and redo is logged before it runs,
+// and the log is replayed when the invoker is made again. Documents are named by their index.
+// With group commit the last commands of a crash may be lost, never a part of one.
+class LoggedDocumentInvoker
+{
+private:
+    vector<Document*> &documents;
+    // Set while the log is replayed, the commands of this invoker stay quiet meanwhile
+    bool replaying;
+    CommandHistory history;
+    HistoryShape shape;
+    CommandLog *log;
+
+    // Run the records of the documents this thread owns, each on a history of its own
+    // An undo or redo of one document is always of the newest command on its own history
+    static void ReplayDocuments(const LogRecord *records, size_t count, vector<Document*> &docs,
+                                vector<CommandHistory*> &histories, const bool *quiet, int thread, int threads)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            const LogRecord &r = records[i];
+            if ((int)(r.doc % threads) != thread) { continue; }
+            CommandHistory *h = histories[r.doc];
+            if (r.action == LogExecute) { h->Push(MakeCommand(r.type, docs[r.doc], quiet)).Execute(); }
+            else if (r.action == LogUndo) { h->Undo(); }
+            else { h->Redo(); }
+        }
+    }
+    // Rebuild the documents and the history from the log, return the records replayed
+    // A pass over the mapped file checks the records and finds the shape of the history,
+    // then the documents are replayed in parallel, each on its own. The torn tail of a crash is cut off.
+    size_t Replay(const string &path, int threads)
+    {
+        int fd = open(path.c_str(), O_RDWR);
+        if (fd < 0) { return 0; }
+        struct stat st;
+        fstat(fd, &st);
+        size_t count = (st.st_size > 8) ? (st.st_size - 8) / sizeof(LogRecord) : 0;
+        if (count == 0)
+        {
+            // At most a header and a torn record, keep the whole header or nothing
+            char header[8];
+            ssize_t have = min(st.st_size, (off_t)8);
+            if (pread(fd, header, have, 0) != have || memcmp(header, CommandLog::Header(), have) != 0)
+            {
+                close(fd);
+                throw runtime_error(path + " is not a command log");
+            }
+            if (st.st_size != 0 && st.st_size != 8) { ftruncate(fd, (st.st_size < 8) ? 0 : 8); }
+            close(fd);
+            return 0;
+        }
+        char *map = (char*)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) { close(fd); throw runtime_error("can't map " + path); }
+        madvise(map, st.st_size, MADV_SEQUENTIAL);
+        if (memcmp(map, CommandLog::Header(), 8) != 0)
+        {
+            munmap(map, st.st_size);
+            close(fd);
+            throw runtime_error(path + " is not a command log");
+        }
+        const LogRecord *records = (const LogRecord*)(map + 8);
+        size_t valid = 0;
+        for (; valid < count; valid++)
+        {
+            const LogRecord &r = records[valid];
+            if (!r.Valid(documents.size())) { break; }
+            if (r.action == LogExecute) { shape.Execute(r.doc); }
+            else if ((r.action == LogUndo ? shape.Undo() : shape.Redo()) != (long)r.doc) { break; }
+        }
+        vector<CommandHistory*> histories(documents.size());
+        for (size_t d = 0; d < documents.size(); d++) { histories[d] = new CommandHistory(shape.depth); }
+        threads = max(1, min(threads, (int)documents.size()));
+        vector<thread> workers;
+        for (int t = 1; t < threads; t++)
+        { workers.push_back(thread(ReplayDocuments, records, valid, ref(documents), ref(histories), &replaying, t, threads)); }
+        ReplayDocuments(records, valid, documents, histories, &replaying, 0, threads);
+        for (size_t t = 0; t < workers.size(); t++) { workers[t].join(); }
+        // The history takes the newest commands of each document, in the order of the shape
+        vector<size_t> taken(documents.size(), 0);
+        vector<SmallCommand> undoable(shape.undo.size());
+        for (size_t i = shape.undo.size(); i-- > 0; )
+        { undoable[i] = std::move(histories[shape.undo[i]]->Undoable(taken[shape.undo[i]]++)); }
+        for (size_t i = 0; i < undoable.size(); i++) { history.Push(std::move(undoable[i])); }
+        fill(taken.begin(), taken.end(), 0);
+        for (size_t i = shape.redo.size(); i-- > 0; )
+        { history.Push(std::move(histories[shape.redo[i]]->Redoable(taken[shape.redo[i]]++))); }
+        history.Rewind(shape.redo.size());
+        for (size_t d = 0; d < documents.size(); d++) { delete histories[d]; }
+        munmap(map, st.st_size);
+        // Cut off invalid records and a torn partial one, or new records would land misaligned after them
+        if ((off_t)(8 + valid * sizeof(LogRecord)) != st.st_size) { ftruncate(fd, 8 + valid * sizeof(LogRecord)); }
+        close(fd);
+        return valid;
+    }
+    void Log(uint32_t doc, LogAction action, int type) { log->Append(LogRecord::Make(doc, action, type)); }
+public:
+    size_t replayed;
+    LoggedDocumentInvoker(const string &path, vector<Document*> &docs, SyncPolicy policy = SyncGroup,
+                          size_t group = 256, size_t depth = 1024, int replayThreads = 4)
+        : documents(docs), replaying(true), history(depth), shape(depth)
+    {
+        replayed = Replay(path, replayThreads);
+        replaying = false;
+        log = new CommandLog(path, policy, group);
+    }
+    ~LoggedDocumentInvoker() { delete log; }
+    // Checked before logging, a record replay would reject must not get into the log
+    void Execute(CommandType type, uint32_t doc)
+    {
+        if (doc >= documents.size() || type > DeleteType) { throw out_of_range("no such document or command type"); }
+        Log(doc, LogExecute, type);
+        shape.Execute(doc);
+        history.Push(MakeCommand(type, documents[doc], &replaying)).Execute();
+    }
+    void Undo()
+    {
+        if (history.UndoCount() == 0) { return; }
+        Log(shape.undo.back(), LogUndo, 0);
+        shape.Undo();
+        history.Undo();
     }
     void Redo()
-    { 
-        if (redoQueue.size() > 0)
+    {
+        if (history.RedoCount() == 0) { return; }
+        Log(shape.redo.back(), LogRedo, 0);
+        shape.Redo();
+        history.Redo();
+    }
+    // Make everything logged so far durable
+    void Commit() { log->Commit(); }
+    // Commit and close the log, throws if anything logged didn't make it
+    void Close() { log->Close(); }
+};
+
+// A command for the benchmark, an edit which takes some time
+// It knows the revision its document must be at, so an edit run out of order is caught
+class EditCommand : public DocumentCommand
+{
+    long before;
+    int work;
+public:
+    static atomic<long> outOfOrder;
+    EditCommand(Document *doc, long rev, int w) : DocumentCommand(doc), before(rev), work(w) { }
+    void Execute()
+    {
+        volatile int spin = 0;
+        for (int i = 0; i < work; i++) { spin = spin + i; }
+        if (document->revision != before) { outOfOrder++; }
+        document->revision++;
+    }
+    void Undo() { document->revision--; }
+};
+atomic<long> EditCommand::outOfOrder(0);
+
+// Commands per second against the number of workers, 4 producers spread edits over 64 documents
+void BenchAsync(long commands, int work)
+{
+    cout << "Async invoker benchmark: " << commands << " edits of " << work << " spin steps, 64 documents, 4 producers" << endl;
+    const int producers = 4, documents = 64;
+    for (int threads = 1; threads <= 8; threads *= 2)
+    {
+        vector<string> names(documents);
+        vector<Document*> docs(documents);
+        for (int d = 0; d < documents; d++)
+        {
+            names[d] = "Doc " + to_string(d);
+            docs[d] = new Document(&names[d][0]);
+        }
+        // Each producer owns some documents, so it knows their revisions when it makes the edits
+        vector<EditCommand> edits;
+        edits.reserve(commands);
+        vector<long> revision(documents, 0);
+        for (long i = 0; i < commands; i++)
+        {
+            int p = i % producers;
+            int d = p + producers * (int)((i / producers) % (documents / producers));
+            edits.push_back(EditCommand(docs[d], revision[d]++, work));
+        }
+        EditCommand::outOfOrder = 0;
+        AsyncDocumentInvoker invoker(threads);
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        vector<thread> feeders;
+        for (int p = 0; p < producers; p++)
+        {
+            feeders.push_back(thread([&, p]() {
+                for (long i = p; i < commands; i += producers) { invoker.Execute(&edits[i]); }
+            }));
+        }
+        for (int p = 0; p < producers; p++) { feeders[p].join(); }
+        invoker.Wait();
+        double sec = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout << "  " << threads << " workers: " << (long)(commands / sec) << " commands/s, "
+             << EditCommand::outOfOrder << " out of order" << endl;
+        for (int d = 0; d < documents; d++) { delete docs[d]; }
+    }
+}
+
+// A session of "commands" edits, one in ten undone and half of those redone
+// The old invoker keeps every command on the heap and never forgets one, it runs a tenth of the
+// session as it would need ~5 GB for the whole one. Each runs in a child process for its peak memory.
+void BenchHistory(long commands)
+{
+    cout << "History benchmark: " << commands << " commands, ring of 1000" << endl;
+    for (int bounded = 0; bounded < 2; bounded++)
+    {
+        cout.flush();
+        pid_t pid = fork();
+        if (pid == 0)
         {
-            DocumentCommand *cmd = *(redoQueue.end() -1);
-            cmd->Execute(); 
-            undoQueue.push_back(cmd);
-            redoQueue.pop_back();
+            char name[] = "Doc";
+            Document doc(name);
+            long ops = bounded ? commands : commands / 10;
+            vector<DocumentCommand*> undoQueue, redoQueue;
+            DocumentInvoker invoker(1000);
+            chrono::steady_clock::time_point start = chrono::steady_clock::now();
+            for (long i = 0; i < ops; i++)
+            {
+                int step = i % 20;
+                if (bounded)
+                {
+                    if (step == 9 || step == 19) { invoker.Undo(); }
+                    else if (step == 10) { invoker.Redo(); }
+                    else { invoker.Execute(EditCommand(&doc, doc.revision, 0)); }
+                    continue;
+                }
+                // The way it was: unbounded vectors of heap commands, redo never cleared
+                if (step == 9 || step == 19)
+                {
+                    if (!undoQueue.empty()) { undoQueue.back()->Undo(); redoQueue.push_back(undoQueue.back()); undoQueue.pop_back(); }
+                }
+                else if (step == 10)
+                {
+                    if (!redoQueue.empty()) { redoQueue.back()->Execute(); undoQueue.push_back(redoQueue.back()); redoQueue.pop_back(); }
+                }
+                else
+                {
+                    DocumentCommand *cmd = new EditCommand(&doc, doc.revision, 0);
+                    undoQueue.push_back(cmd);
+                    cmd->Execute();
+                }
+            }
+            double sec = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            rusage usage;
+            getrusage(RUSAGE_SELF, &usage);
+            cout << "  " << (bounded ? "ring of small commands" : "unbounded heap commands") << ": " << ops << " commands, "
+                 << (long)(ops / sec) << " commands/s, peak memory " << usage.ru_maxrss / 1024 << " MB, "
+                 << EditCommand::outOfOrder << " out of order" << endl;
+            _exit(0);
         }
+        waitpid(pid, NULL, 0);
     }
+}
+
+// Output stream which throws everything away, keeps the benchmark off the terminal
+class NullBuffer : public streambuf
+{
+protected:
+    int overflow(int c) { return c; }
 };
 
+// A synthetic editing trace over 16 documents: 45% display, 15% delete, 25% undo, 15% redo,
+// seven in ten calls on the same document as the one before. Run by the plain invoker and
+// by the batching one, which must leave the documents the same.
+void BenchBatching(long calls)
+{
+    cout << "Batching benchmark: " << calls << " calls, 16 documents, batches of 64" << endl;
+    const int documents = 16;
+    struct Call { int kind, doc; };
+    vector<Call> trace(calls);
+    uint32_t r = 2463534242u;
+    int doc = 0;
+    for (long i = 0; i < calls; i++)
+    {
+        r ^= r << 13; r ^= r >> 17; r ^= r << 5;
+        if (r % 10 >= 7) { doc = (r >> 8) % documents; }
+        int p = (r >> 16) % 100;
+        trace[i].kind = (p < 45) ? 0 : (p < 60) ? 1 : (p < 85) ? 2 : 3;
+        trace[i].doc = doc;
+    }
+    NullBuffer nullBuffer;
+    vector<string> names(documents);
+    for (int d = 0; d < documents; d++) { names[d] = "Doc " + to_string(d); }
+    vector<bool> states[2];
+    for (int batching = 0; batching < 2; batching++)
+    {
+        vector<Document*> docs(documents);
+        for (int d = 0; d < documents; d++) { docs[d] = new Document(&names[d][0]); }
+        vector<DocumentCommand*> cmds;
+        for (long i = 0; i < calls; i++)
+        {
+            if (trace[i].kind == 0) { cmds.push_back(new DisplayCommand(docs[trace[i].doc])); }
+            else if (trace[i].kind == 1) { cmds.push_back(new DeleteCommand(docs[trace[i].doc])); }
+        }
+        DocumentInvoker plain(1024);
+        BatchingDocumentInvoker batched(1024, 64);
+        streambuf *old = cout.rdbuf(&nullBuffer);
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        size_t next = 0;
+        for (long i = 0; i < calls; i++)
+        {
+            int kind = trace[i].kind;
+            if (kind < 2) { if (batching) { batched.Execute(cmds[next++]); } else { plain.Execute(cmds[next++]); } }
+            else if (kind == 2) { if (batching) { batched.Undo(); } else { plain.Undo(); } }
+            else { if (batching) { batched.Redo(); } else { plain.Redo(); } }
+        }
+        batched.Flush();
+        double sec = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout.rdbuf(old);
+        for (int d = 0; d < documents; d++)
+        {
+            states[batching].push_back(docs[d]->shown);
+            states[batching].push_back(docs[d]->deleted);
+        }
+        if (batching)
+        {
+            cout << "  batching: " << (long)(calls / sec) << " calls/s, ran " << batched.executedOps << " of "
+                 << batched.logicalOps << " commands (" << 100.0 * (batched.logicalOps - batched.executedOps) / batched.logicalOps
+                 << "% fewer), documents " << (states[0] == states[1] ? "the same" : "DIFFERENT") << endl;
+        }
+        else { cout << "  plain: " << (long)(calls / sec) << " calls/s" << endl; }
+        for (size_t i = 0; i < cmds.size(); i++) { delete cmds[i]; }
+        for (int d = 0; d < documents; d++) { delete docs[d]; }
+    }
+}
+
+// Random calls on a logged invoker over 16 documents: 60% execute, 25% undo, 15% redo
+void RandomCalls(LoggedDocumentInvoker &invoker, long calls, uint32_t seed)
+{
+    for (long i = 0; i < calls; i++)
+    {
+        seed ^= seed << 13; seed ^= seed >> 17; seed ^= seed << 5;
+        int p = seed % 100;
+        if (p < 60) { invoker.Execute((seed >> 8) & 1 ? DeleteType : DisplayType, (seed >> 12) % 16); }
+        else if (p < 85) { invoker.Undo(); }
+        else { invoker.Redo(); }
+    }
+}
+
+// Logged calls per second with each sync policy, the commands' output goes nowhere
+void BenchLog()
+{
+    cout << "Command log benchmark, calls/s by sync policy" << endl;
+    string path = "/tmp/cmdlog-bench-" + to_string(getpid()) + ".log";
+    NullBuffer nullBuffer;
+    vector<string> names(16);
+    vector<Document*> docs(16);
+    for (int d = 0; d < 16; d++)
+    {
+        names[d] = "Doc " + to_string(d);
+        docs[d] = new Document(&names[d][0]);
+    }
+    struct Case { const char *name; SyncPolicy policy; size_t group; long calls; };
+    Case cases[] = {
+        { "fdatasync every command", SyncEveryCommand, 1, 2000 },
+        { "group commit of 64", SyncGroup, 64, 100000 },
+        { "group commit of 1024", SyncGroup, 1024, 1000000 },
+        { "never sync", SyncNever, 4096, 5000000 },
+    };
+    for (int c = 0; c < 4; c++)
+    {
+        unlink(path.c_str());
+        LoggedDocumentInvoker invoker(path, docs, cases[c].policy, cases[c].group);
+        streambuf *old = cout.rdbuf(&nullBuffer);
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        RandomCalls(invoker, cases[c].calls, 2463534242u);
+        invoker.Commit();
+        double sec = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout.rdbuf(old);
+        cout << "  " << cases[c].name << ": " << (long)(cases[c].calls / sec) << " calls/s" << endl;
+    }
+    unlink(path.c_str());
+    for (int d = 0; d < 16; d++) { delete docs[d]; }
+}
+
+// Replay time of a log of "bytes", written straight to the file in the shape the invoker would
+// A smaller log is first replayed against the invoker that wrote it, documents and undo must agree
+void BenchReplay(size_t bytes)
+{
+    string path = "/tmp/cmdlog-replay-" + to_string(getpid()) + ".log";
+    NullBuffer nullBuffer;
+    vector<string> names(16);
+    vector<Document*> live(16), again(16);
+    for (int d = 0; d < 16; d++)
+    {
+        names[d] = "Doc " + to_string(d);
+        live[d] = new Document(&names[d][0]);
+        again[d] = new Document(&names[d][0]);
+    }
+    streambuf *old = cout.rdbuf(&nullBuffer);
+    bool same = true;
+    {
+        unlink(path.c_str());
+        LoggedDocumentInvoker writer(path, live, SyncNever, 4096);
+        RandomCalls(writer, 300000, 88172645u);
+        writer.Commit();
+        LoggedDocumentInvoker reader(path, again, SyncNever, 4096);
+        for (int i = 0; i <= 1100; i++)
+        {
+            for (int d = 0; d < 16; d++)
+            { same = same && live[d]->shown == again[d]->shown && live[d]->deleted == again[d]->deleted; }
+            writer.Undo();
+            reader.Undo();
+        }
+    }
+    cout.rdbuf(old);
+    cout << "Replay benchmark: replayed state and undo history match the live ones: " << (same ? "yes" : "NO") << endl;
+
+    // The big log
+    unlink(path.c_str());
+    size_t records = (bytes - 8) / sizeof(LogRecord);
+    {
+        CommandLog log(path, SyncNever, 1 << 16);
+        HistoryShape shape(1024);
+        uint32_t r = 2463534242u;
+        for (size_t i = 0; i < records; )
+        {
+            r ^= r << 13; r ^= r >> 17; r ^= r << 5;
+            int p = r % 100;
+            if (p < 60)
+            {
+                uint32_t doc = (r >> 12) % 16;
+                shape.Execute(doc);
+                log.Append(LogRecord::Make(doc, LogExecute, (r >> 8) & 1));
+                i++;
+                continue;
+            }
+            long doc = (p < 85) ? shape.Undo() : shape.Redo();
+            if (doc < 0) { continue; }
+            log.Append(LogRecord::Make(doc, (p < 85) ? LogUndo : LogRedo, 0));
+            i++;
+        }
+    }
+    cout << "  " << records << " records, " << (bytes >> 20) << " MB" << endl;
+    for (int threads = 1; threads <= 4; threads *= 4)
+    {
+        for (int d = 0; d < 16; d++) { delete again[d]; again[d] = new Document(&names[d][0]); }
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        LoggedDocumentInvoker reader(path, again, SyncNever, 4096, 1024, threads);
+        double sec = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout << "  replay with " << threads << " threads: " << sec << " s, " << (long)(reader.replayed / sec)
+             << " records/s, " << (bytes >> 20) / sec << " MB/s" << endl;
+    }
+    unlink(path.c_str());
+    for (int d = 0; d < 16; d++) { delete live[d]; delete again[d]; }
+}
+
+// A log torn by a crash, in the header and in a record: what's appended after the
+// replay has to survive the next one. Returns false on a failure.
+bool TestTornTail()
+{
+    string path = "/tmp/cmdlog-torn-" + to_string(getpid()) + ".log";
+    char name[] = "Doc";
+    Document doc(name);
+    vector<Document*> docs(1, &doc);
+    NullBuffer nullBuffer;
+    streambuf *old = cout.rdbuf(&nullBuffer);
+    bool ok = true;
+    for (int torn = 0; torn < 2; torn++)
+    {
+        unlink(path.c_str());
+        doc.shown = doc.deleted = false;
+        size_t before = 0;
+        if (torn == 0)
+        {
+            // Half a header
+            int fd = open(path.c_str(), O_WRONLY | O_CREAT, 0644);
+            ok = ok && write(fd, CommandLog::Header(), 4) == 4;
+            close(fd);
+        }
+        else
+        {
+            // A synced command, then half a record
+            { LoggedDocumentInvoker writer(path, docs, SyncEveryCommand); writer.Execute(DisplayType, 0); }
+            int fd = open(path.c_str(), O_WRONLY | O_APPEND);
+            ok = ok && write(fd, "torn", 4) == 4;
+            close(fd);
+            before = 1;
+        }
+        {
+            LoggedDocumentInvoker writer(path, docs, SyncEveryCommand);
+            ok = ok && writer.replayed == before;
+            writer.Execute(DeleteType, 0);
+        }
+        doc.shown = doc.deleted = false;
+        LoggedDocumentInvoker reader(path, docs, SyncEveryCommand);
+        ok = ok && reader.replayed == before + 1 && doc.deleted && doc.shown == (torn == 1);
+    }
+    unlink(path.c_str());
+    cout.rdbuf(old);
+    cout << "Torn log tail: " << (ok ? "passed" : "FAILED") << endl;
+    return ok;
+}
+
 // Test command pattern
-int main()
+// Run "main test" for the checks
+// Run "main bench [async [commands]|history [commands]|batching [calls]|log|replay [MB]]" for the benchmarks
+int main(int argc, char *argv[])
 {
+    if (argc > 1 && string(argv[1]) == "test")
+    { return TestTornTail() ? 0 : 1; }
+    if (argc > 1 && string(argv[1]) == "bench")
+    {
+        string which = (argc > 2) ? argv[2] : "";
+        if (which == "" || which == "async")
+        { BenchAsync((argc > 3) ? atol(argv[3]) : 1000000, 200); }
+        if (which == "" || which == "history")
+        { BenchHistory((argc > 3) ? atol(argv[3]) : 100000000); }
+        if (which == "" || which == "batching")
+        { BenchBatching((argc > 3) ? atol(argv[3]) : 5000000); }
+        if (which == "" || which == "log")
+        { BenchLog(); }
+        if (which == "" || which == "replay")
+        { BenchReplay(((argc > 3) ? atol(argv[3]) : 1024) << 20); }
+        return 0;
+    }
+
     // Target objects
     Document *doc = new Document("Mint.iso");
     Document *doc_2 = new Document("Ubuntu.iso");
@@ -116,6 +1191,54 @@ int main()
     invoker->Undo();
     invoker->Undo();
 
+    // Commands by value in a bounded history, only the last two can be undone
+    DocumentInvoker *small = new DocumentInvoker(2);
+    small->Execute(DisplayCommand(doc));
+    small->Execute(DisplayCommand(doc_2));
+    small->Execute(DeleteCommand(doc_2));
+    small->Undo();
+    small->Undo();
+    small->Undo();
+    small->Redo();
+    delete small;
+
+    // Batching invoker, the second display is absorbed and the delete cancels out with its undo
+    BatchingDocumentInvoker *batching = new BatchingDocumentInvoker();
+    DisplayCommand *dispCmd_3 = new DisplayCommand(doc_2);
+    batching->Execute(dispCmd_2);
+    batching->Execute(dispCmd_3);
+    batching->Execute(delCmd);
+    batching->Undo();
+    batching->Flush();
+    cout << batching->executedOps << " of " << batching->logicalOps << " commands ran" << endl;
+    delete batching;
+
+    // Logged invoker, a second one made on the same log finds the documents and history again
+    string logPath = "/tmp/cmdlog-demo-" + to_string(getpid()) + ".log";
+    vector<Document*> docs;
+    docs.push_back(doc);
+    docs.push_back(doc_2);
+    {
+        LoggedDocumentInvoker logged(logPath, docs);
+        logged.Execute(DisplayType, 0);
+        logged.Execute(DeleteType, 1);
+    }
+    doc->shown = doc_2->deleted = false;
+    {
+        LoggedDocumentInvoker logged(logPath, docs);
+        cout << logged.replayed << " commands replayed, " << doc->GetDocName() << (doc->shown ? " shown, " : " hidden, ")
+             << doc_2->GetDocName() << (doc_2->deleted ? " deleted" : " kept") << endl;
+        logged.Undo();
+    }
+    unlink(logPath.c_str());
+
+    // Async invoker, commands run on workers and each call gives a future
+    AsyncDocumentInvoker *async = new AsyncDocumentInvoker(2);
+    async->Execute(dispCmd);
+    async->Execute(delCmd).wait();
+    async->Undo().wait();
+    delete async;
+
     // The end
     return 0;
 }
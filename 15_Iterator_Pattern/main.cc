@@ -10,6 +10,25 @@
  */
 
 #include <iostream>
+#include <string>
+#include <numeric>
+#include <algorithm>
+#include <vector>
+#include <random>
+#include <type_traits>
+#include <chrono>
+#include <cstdlib>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <atomic>
+#include <memory>
+#include <utility>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
 using namespace std;
 
 // iterator interface
@@ -17,6 +36,7 @@ template <class T>
 class IIterator
 {
 public:
+    virtual ~IIterator() { }
     // Get current item
     virtual T CurrentItem() = 0;
     // Whether have next item
@@ -27,11 +47,50 @@ public:
     virtual void Next() = 0;
 };
 
+// A contiguous run of elements, handed out by a block iterator
+template <class T>
+struct Span
+{
+    T *data;
+    size_t size;
+    T *begin() const { return data; }
+    T *end() const { return data + size; }
+    T &operator[](size_t i) const { return data[i]; }
+};
+
+// iterator which also hands out whole blocks, one virtual call per block instead of per element
+template <class T>
+class IBlockIterator : public IIterator<T>
+{
+public:
+    // Next block of at most the block size from the cursor on, false at the end
+    virtual bool NextBlock(Span<T> &block) = 0;
+};
+
+// block iterator which can be cut in two, for a traversal spread over threads
+template <class T>
+class ISplittableIterator : public IBlockIterator<T>
+{
+public:
+    // Hand the first half of what is left to a new iterator and keep the second, NULL if too small
+    virtual ISplittableIterator<T>* TrySplit() = 0;
+    // Elements left from the cursor on
+    virtual size_t Remaining() = 0;
+};
+
+// Software prefetch of what pointer elements point to, nothing for other element types
+template <class T>
+inline void PrefetchTargets(T *, size_t) { }
+template <class T>
+inline void PrefetchTargets(T **p, size_t n)
+{ for (size_t i = 0; i < n; i++) { __builtin_prefetch(p[i]); } }
+
 // container interface
 template <class T>
 class IList
 {
 public:
+    virtual ~IList() { }
     // Provide a iterator
     virtual IIterator<T>* GetIterator() = 0;
 };
@@ -47,6 +106,10 @@ class ConcreteList : public IList<T>
 {
     T list[LENGTH];
 public:
+    // STL style iterators, random access, for range-for and <algorithm>
+    typedef T* iterator;
+    typedef const T* const_iterator;
+
     ConcreteList<T>(T t) // C++11 only
         : list { t, t+4, t-3, t-4, t+5, t-1, t+5, t+8, t-2, t+3 }
     { }
@@ -58,36 +121,844 @@ public:
     // Other common method of a container
     int Length()
     { return LENGTH; }
-    int GetElement(int index)
+    T GetElement(int index)
     { return list[index]; }
+    iterator begin() { return list; }
+    iterator end() { return list + LENGTH; }
+    const_iterator begin() const { return list; }
+    const_iterator end() const { return list + LENGTH; }
 };
 
-// A concrete iterator
+// A concrete iterator, an adapter over the container's begin() and end()
+// For pointer elements, handing out a block prefetches what the next block points to.
+// Blocks of pointers are then at most PrefetchAhead long, so the whole next block is prefetched.
 template <class T>
-class ConcreteIterator : public IIterator<T>
+class ConcreteIterator : public ISplittableIterator<T>
 {
 private:
-    // Have a container member
-    ConcreteList<T> *list;
+    // Range of the container
+    T *first, *last;
     // Current position
-    int index;
+    T *current;
+    size_t blockSize;
+    bool prefetch;
 public:
-    ConcreteIterator<T>(ConcreteList<T> *l) : list(l), index(0)
+    // Pointees prefetched ahead, more than the CPU can have in flight is no use
+    enum { PrefetchAhead = 16 };
+    ConcreteIterator<T>(ConcreteList<T> *l) : first(l->begin()), last(l->end()), current(first),
+        blockSize(LENGTH), prefetch(true)
+    { }
+    ConcreteIterator<T>(T *f, T *l, size_t block) : first(f), last(l), current(f),
+        blockSize(max(block, (size_t)1)), prefetch(true)
     { }
+    void SetPrefetch(bool on) { prefetch = on; }
+    bool NextBlock(Span<T> &block)
+    {
+        if (current == last) { return false; }
+        bool ahead = prefetch && is_pointer<T>::value;
+        size_t n = min(ahead ? min(blockSize, (size_t)PrefetchAhead) : blockSize, (size_t)(last - current));
+        block.data = current;
+        block.size = n;
+        current += n;
+        if (ahead) { PrefetchTargets(current, min(n, (size_t)(last - current))); }
+        return true;
+    }
+    // The split off half gets the same block size and prefetch, First() then goes to the split point
+    ISplittableIterator<T>* TrySplit()
+    {
+        size_t n = last - current;
+        if (n < 2) { return NULL; }
+        ConcreteIterator<T> *prefix = new ConcreteIterator<T>(current, current + n / 2, blockSize);
+        prefix->prefetch = prefetch;
+        first = current = current + n / 2;
+        return prefix;
+    }
+    size_t Remaining()
+    { return last - current; }
     // Implement the interfaces
     bool MoveNext()
-    { return (index < list->Length()); }
+    { return (current != last); }
     T CurrentItem()
-    { return list->GetElement(index) ; }
+    { return *current; }
     void First()
-    { index = 0; }
+    { current = first; }
     void Next()
-    { if (index < list->Length()) { index++; } }
+    { if (current != last) { current++; } }
+};
+
+// A growable container, for any number of elements
+// Adding elements may move them, which makes iterators taken before invalid
+template <class T>
+class DynamicList : public IList<T>
+{
+    vector<T> list;
+public:
+    typedef T* iterator;
+    typedef const T* const_iterator;
+
+    DynamicList() { }
+    // "n" elements from one seed, in the pattern of ConcreteList
+    DynamicList(size_t n, T t)
+    {
+        T offsets[LENGTH] = { 0, 4, -3, -4, 5, -1, 5, 8, -2, 3 };
+        list.reserve(n);
+        for (size_t i = 0; i < n; i++) { list.push_back(t + offsets[i % LENGTH]); }
+    }
+
+    // Implement the interface
+    IIterator<T>* GetIterator()
+    { return new ConcreteIterator<T>(begin(), end(), 256); }
+    IBlockIterator<T>* GetBlockIterator(size_t blockSize)
+    { return new ConcreteIterator<T>(begin(), end(), blockSize); }
+    ISplittableIterator<T>* GetSplittableIterator(size_t blockSize = 256)
+    { return new ConcreteIterator<T>(begin(), end(), blockSize); }
+
+    // Other common method of a container
+    void Add(const T &t) { list.push_back(t); }
+    void Reserve(size_t n) { list.reserve(n); }
+    void Resize(size_t n) { list.resize(n); }
+    size_t Length()
+    { return list.size(); }
+    T GetElement(size_t index)
+    { return list[index]; }
+    iterator begin() { return list.data(); }
+    iterator end() { return list.data() + list.size(); }
+    const_iterator begin() const { return list.data(); }
+    const_iterator end() const { return list.data() + list.size(); }
+};
+
+// A small work stealing thread pool, the one of 09_Composite_Pattern as each example stands alone
+// Each worker pops tasks from the back of its own queue and steals from the front of others
+class WorkStealingPool
+{
+private:
+    struct Queue
+    {
+        mutex lock;
+        deque<function<void()> > tasks;
+    };
+    vector<Queue*> queues;
+    vector<thread> workers;
+    atomic<bool> stop;
+    atomic<unsigned> next;
+    // Tasks in the queues, idle workers sleep until there are some
+    // Raised under sleepLock so a worker about to sleep can't miss it
+    atomic<long> queued;
+    mutex sleepLock;
+    condition_variable wake;
+    // Pool and index of the worker running on this thread, NULL and -1 for other threads
+    static thread_local WorkStealingPool *owner;
+    static thread_local int self;
+
+    // Index of the calling worker in this pool, a worker of another pool counts as outside
+    int Self()
+    { return (owner == this) ? self : -1; }
+    void Work(int index)
+    {
+        owner = this;
+        self = index;
+        while (true)
+        {
+            if (RunOne()) { continue; }
+            unique_lock<mutex> lk(sleepLock);
+            wake.wait(lk, [this] { return stop || queued > 0; });
+            if (stop) { break; }
+        }
+    }
+public:
+    WorkStealingPool(unsigned n) : stop(false), next(0), queued(0)
+    {
+        if (n == 0) { n = 1; }
+        for (unsigned i = 0; i < n; i++)
+        { queues.push_back(new Queue()); }
+        for (unsigned i = 0; i < n; i++)
+        { workers.push_back(thread(&WorkStealingPool::Work, this, (int)i)); }
+    }
+    ~WorkStealingPool()
+    {
+        {
+            lock_guard<mutex> lk(sleepLock);
+            stop = true;
+        }
+        wake.notify_all();
+        for (size_t i = 0; i < workers.size(); i++)
+        { workers[i].join(); }
+        for (size_t i = 0; i < queues.size(); i++)
+        { delete queues[i]; }
+    }
+    unsigned Size()
+    { return workers.size(); }
+    // Push to the queue of the calling worker, or spread over the queues from outside
+    void Submit(function<void()> task)
+    {
+        int me = Self();
+        int i = (me >= 0) ? me : (int)(next++ % queues.size());
+        {
+            lock_guard<mutex> lk(queues[i]->lock);
+            queues[i]->tasks.push_back(task);
+        }
+        {
+            lock_guard<mutex> lk(sleepLock);
+            queued++;
+        }
+        wake.notify_one();
+    }
+    // Run one pending task if there is any, waiting threads call it to help out
+    bool RunOne()
+    {
+        int n = queues.size();
+        int me = Self();
+        int start = (me >= 0) ? me : (int)(next % n);
+        for (int k = 0; k < n; k++)
+        {
+            Queue *q = queues[(start + k) % n];
+            function<void()> task;
+            {
+                lock_guard<mutex> lk(q->lock);
+                if (q->tasks.empty()) { continue; }
+                if (k == 0 && me >= 0) { task = q->tasks.back(); q->tasks.pop_back(); }
+                else { task = q->tasks.front(); q->tasks.pop_front(); }
+            }
+            queued--;
+            task();
+            return true;
+        }
+        return false;
+    }
+};
+// Initialize static members
+thread_local WorkStealingPool *WorkStealingPool::owner = NULL;
+thread_local int WorkStealingPool::self = -1;
+
+// A set of tasks to wait for, the waiting thread keeps running tasks meanwhile
+class TaskGroup
+{
+private:
+    WorkStealingPool *pool;
+    atomic<int> pending;
+public:
+    TaskGroup(WorkStealingPool *p) : pool(p), pending(0) { }
+    void Spawn(function<void()> task)
+    {
+        pending++;
+        pool->Submit([this, task]() { task(); pending--; });
+    }
+    void Wait()
+    {
+        while (pending > 0)
+        { if (!pool->RunOne()) { this_thread::yield(); } }
+    }
+};
+
+// Run "leaf" on parts of the iterator, in parallel on the pool, and delete them after
+// Parts are split in halves down to "grain" elements. The halves split off are spawned first,
+// so a thief takes the biggest piece left. A grain of 0 makes about 8 parts per worker.
+template <class T, class Leaf>
+void ParallelSplit(WorkStealingPool &pool, ISplittableIterator<T> *it, size_t grain, const Leaf &leaf)
+{
+    if (grain == 0) { grain = max(it->Remaining() / (pool.Size() * 8), (size_t)4096); }
+    TaskGroup group(&pool);
+    function<void(ISplittableIterator<T>*)> run = [&](ISplittableIterator<T> *part)
+    {
+        ISplittableIterator<T> *prefix;
+        while (part->Remaining() > grain && (prefix = part->TrySplit()) != NULL)
+        { group.Spawn([&run, prefix]() { run(prefix); }); }
+        leaf(part);
+        delete part;
+    };
+    run(it);
+    group.Wait();
+}
+
+// Call "fn" on every element, the iterator is taken over
+template <class T, class Fn>
+void ParallelForEach(WorkStealingPool &pool, ISplittableIterator<T> *it, Fn fn, size_t grain = 0)
+{
+    ParallelSplit(pool, it, grain, [&](ISplittableIterator<T> *part)
+    {
+        Span<T> block;
+        while (part->NextBlock(block)) { for (T &t : block) { fn(t); } }
+    });
+}
+
+// Fold the elements into "identity" with "acc", then the parts together with "combine"
+// Parts finish in any order, so "combine" has to be associative and commutative
+template <class T, class R, class Acc, class Combine>
+R ParallelReduce(WorkStealingPool &pool, ISplittableIterator<T> *it, R identity, Acc acc, Combine combine,
+    size_t grain = 0)
+{
+    R result = identity;
+    mutex lock;
+    ParallelSplit(pool, it, grain, [&](ISplittableIterator<T> *part)
+    {
+        R r = identity;
+        Span<T> block;
+        while (part->NextBlock(block)) { for (const T &t : block) { r = acc(r, t); } }
+        lock_guard<mutex> lk(lock);
+        result = combine(result, r);
+    });
+    return result;
+}
+
+// out[i] = fn(in[i]), "out" is resized to the length of "in"
+template <class T, class U, class Fn>
+void ParallelTransform(WorkStealingPool &pool, DynamicList<T> &in, DynamicList<U> &out, Fn fn, size_t grain = 0)
+{
+    out.Resize(in.Length());
+    T *base = in.begin();
+    U *to = out.begin();
+    ParallelSplit(pool, in.GetSplittableIterator(), grain, [&](ISplittableIterator<T> *part)
+    {
+        Span<T> block;
+        while (part->NextBlock(block))
+        {
+            U *o = to + (block.data - base);
+            for (size_t i = 0; i < block.size; i++) { o[i] = fn(block[i]); }
+        }
+    });
+}
+
+// Lazy adapters over IIterator, each owns its source and pulls from it only when asked
+// Only Chunk holds elements, so a chain of them is a single pass without containers between stages
+template <class T, class Fn>
+using MapResult = typename decay<decltype(declval<Fn&>()(declval<T>()))>::type;
+
+// Elements for which "pred" holds
+template <class T, class Pred>
+class FilterIterator : public IIterator<T>
+{
+    IIterator<T> *source;
+    Pred pred;
+    void Skip()
+    { while (source->MoveNext() && !pred(source->CurrentItem())) { source->Next(); } }
+public:
+    FilterIterator(IIterator<T> *s, Pred p) : source(s), pred(p) { Skip(); }
+    ~FilterIterator() { delete source; }
+    T CurrentItem() { return source->CurrentItem(); }
+    bool MoveNext() { return source->MoveNext(); }
+    void First() { source->First(); Skip(); }
+    void Next() { source->Next(); Skip(); }
+};
+
+// "fn" of every element, worked out on each CurrentItem()
+template <class T, class Fn>
+class MapIterator : public IIterator<MapResult<T, Fn> >
+{
+    IIterator<T> *source;
+    Fn fn;
+public:
+    MapIterator(IIterator<T> *s, Fn f) : source(s), fn(f) { }
+    ~MapIterator() { delete source; }
+    MapResult<T, Fn> CurrentItem() { return fn(source->CurrentItem()); }
+    bool MoveNext() { return source->MoveNext(); }
+    void First() { source->First(); }
+    void Next() { source->Next(); }
+};
+
+// The first "n" elements
+template <class T>
+class TakeIterator : public IIterator<T>
+{
+    IIterator<T> *source;
+    size_t n, taken;
+public:
+    TakeIterator(IIterator<T> *s, size_t count) : source(s), n(count), taken(0) { }
+    ~TakeIterator() { delete source; }
+    T CurrentItem() { return source->CurrentItem(); }
+    bool MoveNext() { return taken < n && source->MoveNext(); }
+    void First() { source->First(); taken = 0; }
+    void Next() { if (taken < n) { source->Next(); taken++; } }
+};
+
+// Pairs of elements from two sources, as long as the shorter one
+template <class T, class U>
+class ZipIterator : public IIterator<pair<T, U> >
+{
+    IIterator<T> *left;
+    IIterator<U> *right;
+public:
+    ZipIterator(IIterator<T> *l, IIterator<U> *r) : left(l), right(r) { }
+    ~ZipIterator() { delete left; delete right; }
+    pair<T, U> CurrentItem() { return make_pair(left->CurrentItem(), right->CurrentItem()); }
+    bool MoveNext() { return left->MoveNext() && right->MoveNext(); }
+    void First() { left->First(); right->First(); }
+    void Next() { left->Next(); right->Next(); }
+};
+
+// Runs of "n" elements, the last one may be shorter
+template <class T>
+class ChunkIterator : public IIterator<vector<T> >
+{
+    IIterator<T> *source;
+    size_t n;
+    vector<T> chunk;
+    void Fill()
+    {
+        chunk.clear();
+        for (; chunk.size() < n && source->MoveNext(); source->Next()) { chunk.push_back(source->CurrentItem()); }
+    }
+public:
+    ChunkIterator(IIterator<T> *s, size_t count) : source(s), n(max(count, (size_t)1)) { Fill(); }
+    ~ChunkIterator() { delete source; }
+    vector<T> CurrentItem() { return chunk; }
+    bool MoveNext() { return !chunk.empty(); }
+    void First() { source->First(); Fill(); }
+    void Next() { Fill(); }
+};
+
+template <class T, class Pred>
+IIterator<T>* Filter(IIterator<T> *source, Pred pred)
+{ return new FilterIterator<T, Pred>(source, pred); }
+template <class T, class Fn>
+IIterator<MapResult<T, Fn> >* Map(IIterator<T> *source, Fn fn)
+{ return new MapIterator<T, Fn>(source, fn); }
+template <class T>
+IIterator<T>* Take(IIterator<T> *source, size_t n)
+{ return new TakeIterator<T>(source, n); }
+template <class T, class U>
+IIterator<pair<T, U> >* Zip(IIterator<T> *left, IIterator<U> *right)
+{ return new ZipIterator<T, U>(left, right); }
+template <class T>
+IIterator<vector<T> >* Chunk(IIterator<T> *source, size_t n)
+{ return new ChunkIterator<T>(source, n); }
+
+// The same adapters known at compile time
+template <class Src, class Pred> class FilterPipe;
+template <class Src, class Fn> class MapPipe;
+template <class Src> class TakePipe;
+template <class Src, class Other> class ZipPipe;
+template <class Src> class ChunkPipe;
+template <class P> class PipeIterator;
+
+// A stage of a pipeline, Derived::Next(T&) pulls the next element or returns false at the end
+// Stages hold their source by value, so the whole chain inlines into one loop
+template <class Derived, class T>
+class Pipe
+{
+    Derived &Self() { return static_cast<Derived&>(*this); }
+public:
+    typedef T Item;
+    template <class Pred>
+    FilterPipe<Derived, Pred> Filter(Pred pred) { return FilterPipe<Derived, Pred>(Self(), pred); }
+    template <class Fn>
+    MapPipe<Derived, Fn> Map(Fn fn) { return MapPipe<Derived, Fn>(Self(), fn); }
+    TakePipe<Derived> Take(size_t n) { return TakePipe<Derived>(Self(), n); }
+    template <class Other>
+    ZipPipe<Derived, Other> Zip(const Other &other) { return ZipPipe<Derived, Other>(Self(), other); }
+    ChunkPipe<Derived> Chunk(size_t n) { return ChunkPipe<Derived>(Self(), n); }
+
+    // Pull everything through
+    template <class Fn>
+    void ForEach(Fn fn)
+    {
+        T t;
+        while (Self().Next(t)) { fn(t); }
+    }
+    vector<T> Collect()
+    {
+        vector<T> all;
+        ForEach([&](const T &t) { all.push_back(t); });
+        return all;
+    }
+    // Type erased, for code which takes an IIterator
+    IIterator<T>* GetIterator() { return new PipeIterator<Derived>(Self()); }
+};
+
+// Source over a range of elements
+template <class T>
+class RangePipe : public Pipe<RangePipe<T>, T>
+{
+    T *current, *last;
+public:
+    RangePipe(T *f, T *l) : current(f), last(l) { }
+    bool Next(T &t)
+    {
+        if (current == last) { return false; }
+        t = *current++;
+        return true;
+    }
+};
+
+// Source over an IIterator, which it doesn't own
+// A copy starts again from First()
+template <class T>
+class IteratorPipe : public Pipe<IteratorPipe<T>, T>
+{
+    IIterator<T> *source;
+    bool started;
+public:
+    IteratorPipe(IIterator<T> *s) : source(s), started(false) { }
+    IteratorPipe(const IteratorPipe &other) : source(other.source), started(false) { }
+    bool Next(T &t)
+    {
+        if (!started) { source->First(); started = true; }
+        if (!source->MoveNext()) { return false; }
+        t = source->CurrentItem();
+        source->Next();
+        return true;
+    }
+};
+
+template <class T>
+RangePipe<T> From(T *first, T *last)
+{ return RangePipe<T>(first, last); }
+template <class L>
+RangePipe<typename remove_pointer<typename L::iterator>::type> From(L &list)
+{ return From(list.begin(), list.end()); }
+template <class T>
+IteratorPipe<T> From(IIterator<T> *source)
+{ return IteratorPipe<T>(source); }
+
+template <class Src, class Pred>
+class FilterPipe : public Pipe<FilterPipe<Src, Pred>, typename Src::Item>
+{
+    Src source;
+    Pred pred;
+public:
+    FilterPipe(const Src &s, Pred p) : source(s), pred(p) { }
+    bool Next(typename Src::Item &t)
+    {
+        while (source.Next(t)) { if (pred(t)) { return true; } }
+        return false;
+    }
+};
+
+template <class Src, class Fn>
+class MapPipe : public Pipe<MapPipe<Src, Fn>, MapResult<typename Src::Item, Fn> >
+{
+    Src source;
+    Fn fn;
+public:
+    MapPipe(const Src &s, Fn f) : source(s), fn(f) { }
+    bool Next(MapResult<typename Src::Item, Fn> &u)
+    {
+        typename Src::Item t;
+        if (!source.Next(t)) { return false; }
+        u = fn(t);
+        return true;
+    }
+};
+
+template <class Src>
+class TakePipe : public Pipe<TakePipe<Src>, typename Src::Item>
+{
+    Src source;
+    size_t left;
+public:
+    TakePipe(const Src &s, size_t n) : source(s), left(n) { }
+    bool Next(typename Src::Item &t)
+    {
+        if (left == 0 || !source.Next(t)) { return false; }
+        left--;
+        return true;
+    }
+};
+
+template <class Src, class Other>
+class ZipPipe : public Pipe<ZipPipe<Src, Other>, pair<typename Src::Item, typename Other::Item> >
+{
+    Src left;
+    Other right;
+public:
+    ZipPipe(const Src &l, const Other &r) : left(l), right(r) { }
+    bool Next(pair<typename Src::Item, typename Other::Item> &p)
+    { return left.Next(p.first) && right.Next(p.second); }
+};
+
+// The chunk handed to Next() is refilled, pulling into the same vector again doesn't allocate
+template <class Src>
+class ChunkPipe : public Pipe<ChunkPipe<Src>, vector<typename Src::Item> >
+{
+    Src source;
+    size_t n;
+public:
+    ChunkPipe(const Src &s, size_t count) : source(s), n(max(count, (size_t)1)) { }
+    bool Next(vector<typename Src::Item> &chunk)
+    {
+        chunk.clear();
+        typename Src::Item t;
+        while (chunk.size() < n && source.Next(t)) { chunk.push_back(t); }
+        return !chunk.empty();
+    }
+};
+
+// A pipeline as IIterator, First() runs a fresh copy of it
+template <class P>
+class PipeIterator : public IIterator<typename P::Item>
+{
+    P start;
+    unique_ptr<P> pipe;
+    typename P::Item item;
+    bool has;
+public:
+    PipeIterator(const P &p) : start(p) { First(); }
+    typename P::Item CurrentItem() { return item; }
+    bool MoveNext() { return has; }
+    void First() { pipe.reset(new P(start)); has = pipe->Next(item); }
+    void Next() { if (has) { has = pipe->Next(item); } }
 };
 
+// Sum of 100M elements, 10M passes over the list, through IIterator and through begin() and end()
+// The list is reached through a volatile pointer, so the compiler can't skip the virtual calls
+void BenchSum(long passes)
+{
+    cout << "Sum benchmark: " << passes * LENGTH << " elements" << endl;
+    ConcreteList<int> concrete(7);
+    IList<int> * volatile list = &concrete;
+    const char *names[] = { "IIterator, one per pass", "IIterator, First() per pass", "range-for", "std::accumulate" };
+    for (int way = 0; way < 4; way++)
+    {
+        long sum = 0;
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        if (way == 0)
+        {
+            for (long p = 0; p < passes; p++)
+            {
+                IIterator<int> *it = list->GetIterator();
+                for (; it->MoveNext(); it->Next()) { sum += it->CurrentItem(); }
+                delete it;
+            }
+        }
+        else if (way == 1)
+        {
+            IIterator<int> *it = list->GetIterator();
+            for (long p = 0; p < passes; p++)
+            { for (it->First(); it->MoveNext(); it->Next()) { sum += it->CurrentItem(); } }
+            delete it;
+        }
+        else
+        {
+            ConcreteList<int> &l = *static_cast<ConcreteList<int>*>((IList<int>*)list);
+            for (long p = 0; p < passes; p++)
+            {
+                if (way == 2) { for (int v : l) { sum += v; } }
+                else { sum = accumulate(l.begin(), l.end(), sum); }
+                // Keep the passes from being folded into one multiply
+                asm volatile("" : "+r"(sum));
+            }
+        }
+        double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / (passes * LENGTH);
+        cout << "  " << names[way] << ": " << ns << " ns/element, sum " << sum << endl;
+    }
+}
+
+// Element of the pointer heavy benchmark, a cache line each
+struct Node
+{
+    long value;
+    char pad[56];
+};
+
+// Nanoseconds per element through NextBlock for block sizes from 1 to 4096
+// Ints are summed in place. Pointers lead to nodes spread over 512 MB in random order, each
+// gets a little work, which is where the prefetch of the next block can help.
+void BenchBlocks(size_t n)
+{
+    cout << "Block benchmark: " << n << " ints, " << n / 8 << " node pointers" << endl;
+    DynamicList<int> ints(n, 7);
+    size_t nodes = n / 8;
+    vector<Node> storage(nodes);
+    DynamicList<Node*> pointers;
+    pointers.Reserve(nodes);
+    for (size_t i = 0; i < nodes; i++) { storage[i].value = i & 7; pointers.Add(&storage[i]); }
+    shuffle(pointers.begin(), pointers.end(), mt19937(42));
+    IList<int> * volatile list = &ints;
+    long expected = 0, nodesSum = 0;
+    {
+        IIterator<int> *it = list->GetIterator();
+        long sum = 0;
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        for (; it->MoveNext(); it->Next()) { sum += it->CurrentItem(); }
+        double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / n;
+        cout << "  ints, per element calls: " << ns << " ns/element" << endl;
+        expected = sum;
+        delete it;
+    }
+    for (size_t block = 1; block <= 4096; block *= 4)
+    {
+        cout << "  block " << block << ":";
+        IBlockIterator<int> *it = ints.GetBlockIterator(block);
+        Span<int> span;
+        long sum = 0;
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        while (it->NextBlock(span)) { for (int v : span) { sum += v; } }
+        cout << " ints " << chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / n << " ns";
+        if (sum != expected) { cout << " (WRONG SUM)"; }
+        delete it;
+        for (int prefetch = 0; prefetch < 2; prefetch++)
+        {
+            ConcreteIterator<Node*> *pit = static_cast<ConcreteIterator<Node*>*>(pointers.GetBlockIterator(block));
+            pit->SetPrefetch(prefetch);
+            IBlockIterator<Node*> *bit = pit;
+            Span<Node*> nspan;
+            long nsum = 0;
+            start = chrono::steady_clock::now();
+            while (bit->NextBlock(nspan))
+            {
+                for (Node *node : nspan)
+                {
+                    long v = node->value;
+                    for (int k = 0; k < 12; k++) { v = v * 3 % 1000003; }
+                    nsum += v;
+                }
+            }
+            cout << ", nodes " << (prefetch ? "with" : "without") << " prefetch "
+                 << chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / nodes << " ns";
+            if (prefetch && nsum != nodesSum) { cout << " (WRONG SUM)"; }
+            nodesSum = nsum;
+            delete bit;
+        }
+        cout << endl;
+    }
+}
+
+// Time per element of reduce, transform and for_each, sequential and on pools of 1 to N workers
+// About 1G elements are visited for reduce, as passes over a list of "n" ints
+void BenchParallel(size_t n)
+{
+    unsigned cores = thread::hardware_concurrency();
+    unsigned most = max(cores, 8u);
+    long passes = max((1000000000L + (long)n - 1) / (long)n, 1L);
+    cout << "Parallel benchmark: " << n << " ints, reduce " << passes << " passes, " << cores << " cores" << endl;
+    DynamicList<int> in(n, 7), out;
+    out.Resize(n);
+    long expected = 0;
+    double seqReduce = 0;
+    for (unsigned workers = 0; workers <= most; workers = workers ? workers * 2 : 1)
+    {
+        WorkStealingPool *pool = workers ? new WorkStealingPool(workers) : NULL;
+        long sum = 0;
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        for (long p = 0; p < passes; p++)
+        {
+            ISplittableIterator<int> *it = in.GetSplittableIterator();
+            if (pool)
+            {
+                sum += ParallelReduce(*pool, it, 0L,
+                    [](long s, int v) { return s + v; }, [](long a, long b) { return a + b; });
+            }
+            else
+            {
+                Span<int> block;
+                while (it->NextBlock(block)) { for (int v : block) { sum += v; } }
+                delete it;
+            }
+            asm volatile("" : "+r"(sum));
+        }
+        double reduce = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / (passes * n);
+        if (!pool) { expected = sum; seqReduce = reduce; }
+
+        start = chrono::steady_clock::now();
+        if (pool)
+        {
+            ParallelTransform(*pool, in, out, [](int v) { return v * 3 + 1; });
+        }
+        else
+        {
+            for (size_t i = 0; i < n; i++) { out.begin()[i] = in.begin()[i] * 3 + 1; }
+        }
+        double transform = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / n;
+        // Two passes of for_each flip every element and back
+        start = chrono::steady_clock::now();
+        for (int p = 0; p < 2; p++)
+        {
+            if (pool) { ParallelForEach(*pool, in.GetSplittableIterator(), [](int &v) { v = ~v; }); }
+            else { for (int &v : in) { v = ~v; } }
+        }
+        double forEach = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / (2 * n);
+
+        cout << "  " << (pool ? to_string(workers) + " workers" : string("sequential")) << ": reduce "
+             << reduce << " ns/element (x" << seqReduce / reduce << "), transform " << transform
+             << " ns, for_each " << forEach << " ns";
+        if (sum != expected || out.begin()[n - 1] != in.begin()[n - 1] * 3 + 1) { cout << " (WRONG RESULT)"; }
+        cout << endl;
+        delete pool;
+    }
+}
+
+// One pipeline over "n" ints, with vectors between the stages, fused at compile time and
+// chained through IIterator. Each runs in a child process of its own for the peak memory.
+// The odd elements squared are zipped with the elements plus one, multiplied, the first half of
+// that taken and cut in chunks of 16, and the largest of each chunk summed up.
+void BenchPipeline(size_t n)
+{
+    cout << "Pipeline benchmark: " << n << " ints, list " << n * sizeof(int) / (1024 * 1024) << " MB" << endl;
+    const char *names[] = { "materialized", "template", "IIterator" };
+    for (int way = 0; way < 3; way++)
+    {
+        cout.flush();
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            DynamicList<int> list(n, 7);
+            auto odd = [](int v) { return v % 2 != 0; };
+            auto square = [](int v) { return (long)v * v; };
+            auto plusOne = [](int v) { return v + 1; };
+            auto product = [](const pair<long, int> &p) { return p.first * p.second; };
+            auto largest = [](const vector<long> &c) { return *max_element(c.begin(), c.end()); };
+            long sum = 0;
+            chrono::steady_clock::time_point start = chrono::steady_clock::now();
+            if (way == 0)
+            {
+                vector<int> odds;
+                for (int v : list) { if (odd(v)) { odds.push_back(v); } }
+                vector<long> squares;
+                for (int v : odds) { squares.push_back(square(v)); }
+                vector<int> plus;
+                for (int v : list) { plus.push_back(plusOne(v)); }
+                vector<pair<long, int> > zipped;
+                for (size_t i = 0; i < squares.size() && i < plus.size(); i++)
+                { zipped.push_back(make_pair(squares[i], plus[i])); }
+                vector<long> products;
+                for (const pair<long, int> &p : zipped) { products.push_back(product(p)); }
+                products.resize(min(products.size(), n / 2));
+                vector<vector<long> > chunks;
+                for (size_t i = 0; i < products.size(); i += 16)
+                { chunks.push_back(vector<long>(products.begin() + i, products.begin() + min(i + 16, products.size()))); }
+                for (const vector<long> &c : chunks) { sum += largest(c); }
+            }
+            else if (way == 1)
+            {
+                From(list).Filter(odd).Map(square).Zip(From(list).Map(plusOne))
+                    .Map(product).Take(n / 2).Chunk(16).Map(largest)
+                    .ForEach([&](long v) { sum += v; });
+            }
+            else
+            {
+                IIterator<long> *it = Map(Chunk(Take(Map(Zip(Map(Filter(list.GetIterator(), odd), square),
+                    Map(list.GetIterator(), plusOne)), product), n / 2), 16), largest);
+                for (; it->MoveNext(); it->Next()) { sum += it->CurrentItem(); }
+                delete it;
+            }
+            double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+            rusage usage;
+            getrusage(RUSAGE_SELF, &usage);
+            cout << "  " << names[way] << ": " << ms << " ms, peak memory " << usage.ru_maxrss / 1024
+                 << " MB, sum " << sum << endl;
+            _exit(0);
+        }
+        waitpid(pid, NULL, 0);
+    }
+}
+
 // Test iterator pattern
-int main()
+// Run "main bench [sum|blocks|parallel|pipeline [elements]]" for the benchmarks
+int main(int argc, char *argv[])
 {
+    if (argc > 1 && string(argv[1]) == "bench")
+    {
+        string which = (argc > 2) ? argv[2] : "";
+        if (which == "" || which == "sum")
+        { BenchSum(10000000); }
+        if (which == "" || which == "blocks")
+        { BenchBlocks((argc > 3) ? atol(argv[3]) : 64000000); }
+        if (which == "" || which == "parallel")
+        { BenchParallel((argc > 3) ? atol(argv[3]) : 256000000); }
+        if (which == "" || which == "pipeline")
+        { BenchPipeline((argc > 3) ? atol(argv[3]) : 32000000); }
+        return 0;
+    }
+
     IIterator<int> *iterator;
     IList<int> *list = new ConcreteList<int>(7);
     iterator = list->GetIterator();
@@ -97,6 +968,50 @@ int main()
         cout << (int)iterator->CurrentItem() << endl;
         iterator->Next();
     }
+    delete iterator;
+
+    // The same with the STL style iterators
+    ConcreteList<int> *concrete = static_cast<ConcreteList<int>*>(list);
+    for (int v : *concrete) { cout << v << " "; }
+    cout << endl;
+    cout << "max " << *max_element(concrete->begin(), concrete->end()) << endl;
+
+    // A growable list walked in blocks of 4
+    DynamicList<int> *dynamic = new DynamicList<int>(6, 7);
+    dynamic->Add(100);
+    IBlockIterator<int> *blocks = dynamic->GetBlockIterator(4);
+    Span<int> block;
+    while (blocks->NextBlock(block))
+    {
+        for (int v : block) { cout << v << " "; }
+        cout << "| ";
+    }
+    cout << endl;
+    delete blocks;
+
+    // The same list summed and transformed on a work stealing pool
+    WorkStealingPool pool(2);
+    long sum = ParallelReduce(pool, dynamic->GetSplittableIterator(2), 0L,
+        [](long s, int v) { return s + v; }, [](long a, long b) { return a + b; }, 2);
+    DynamicList<int> doubled;
+    ParallelTransform(pool, *dynamic, doubled, [](int v) { return v * 2; }, 2);
+    cout << "parallel sum " << sum << ", doubled";
+    for (int v : doubled) { cout << " " << v; }
+    cout << endl;
+
+    // Lazy pipelines, fused at compile time and chained through IIterator
+    auto odd = [](int v) { return v % 2 != 0; };
+    auto square = [](int v) { return v * v; };
+    for (int v : From(*concrete).Filter(odd).Map(square).Take(3).Collect()) { cout << v << " "; }
+    cout << "| ";
+    IIterator<vector<int> > *chunks = Chunk(Map(Filter(list->GetIterator(), odd), square), 2);
+    for (; chunks->MoveNext(); chunks->Next())
+    {
+        for (int v : chunks->CurrentItem()) { cout << v << " "; }
+        cout << "| ";
+    }
+    cout << endl;
+    delete chunks;
 
     // The end
     return 0;
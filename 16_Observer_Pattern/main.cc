@@ -18,28 +18,224 @@
 #include <iostream>
 #include <vector>
 #include <string>
+#include <cstdint>
+#include <new>
+#include <memory>
+#include <utility>
+#include <type_traits>
+#include <functional>
+#include <algorithm>
+#include <random>
+#include <chrono>
+#include <cstdlib>
 using namespace std;
 
-// Declaration
-class Emailer;
-class Mobile;
+// Observers of one event, any callable taking "Arg", kept by value in one contiguous array
+// Callables of up to Capacity bytes sit in their slot, bigger ones are moved to the heap.
+// Subscribe hands out a token. Unsubscribe moves the last slot into the hole, so it takes
+// constant time and the order of notification is not kept.
+// Observers may subscribe and unsubscribe while notified, the array is settled after the loop.
+template <class Arg>
+class ObserverRegistry
+{
+public:
+    enum { Capacity = 16 };
+    struct Token
+    {
+        uint32_t id, generation;
+        Token() : id(~0u), generation(0) { }
+        Token(uint32_t i, uint32_t g) : id(i), generation(g) { }
+    };
+private:
+    typedef void (*Invoke)(void*, Arg);
+    struct Ops
+    {
+        Invoke invoke;
+        void (*move)(void *from, void *to);
+        void (*destroy)(void*);
+    };
+    template <class F>
+    struct OpsOf
+    {
+        static void Invoke(void *p, Arg arg) { (*static_cast<F*>(p))(arg); }
+        static void Move(void *from, void *to) { new (to) F(std::move(*static_cast<F*>(from))); }
+        static void Destroy(void *p) { static_cast<F*>(p)->~F(); }
+        static const Ops table;
+    };
+    // Holds a callable too big for a slot
+    template <class F>
+    struct Boxed
+    {
+        unique_ptr<F> f;
+        void operator()(Arg arg) { (*f)(arg); }
+    };
+    enum : uint32_t { Dead = ~0u };
+    static void Skip(void*, Arg) { }
+    // "invoke" is kept in the slot for one load less per call, it is Skip once unsubscribed
+    struct Slot
+    {
+        Invoke invoke;
+        const Ops *ops;
+        // Index in handles, Dead once unsubscribed
+        uint32_t handle;
+        alignas(8) unsigned char buf[Capacity];
+        Slot() : invoke(&Skip), ops(NULL), handle(Dead) { }
+        Slot(Slot &&other) noexcept : invoke(other.invoke), ops(other.ops), handle(other.handle)
+        { if (ops) { ops->move(other.buf, buf); } }
+        Slot &operator=(Slot &&other) noexcept
+        {
+            Reset();
+            invoke = other.invoke;
+            ops = other.ops;
+            handle = other.handle;
+            if (ops) { ops->move(other.buf, buf); }
+            return *this;
+        }
+        ~Slot() { Reset(); }
+        void Reset()
+        {
+            if (ops) { ops->destroy(buf); }
+            ops = NULL;
+        }
+    };
+    // Where the slot of a token is, slots added while notifying are counted on from the end of "slots"
+    struct Handle
+    {
+        uint32_t slot, generation;
+    };
+    vector<Slot> slots;
+    vector<Slot> added;
+    vector<Handle> handles;
+    vector<uint32_t> freeHandles;
+    size_t dead;
+    int notifying;
+
+    template <class C>
+    struct Fits : integral_constant<bool, sizeof(C) <= Capacity && alignof(C) <= 8 &&
+        is_nothrow_move_constructible<C>::value> { };
+    template <class F>
+    void Place(Slot &slot, F &&f, true_type)
+    {
+        typedef typename decay<F>::type C;
+        slot.ops = &OpsOf<C>::table;
+        slot.invoke = slot.ops->invoke;
+        new (slot.buf) C(std::forward<F>(f));
+    }
+    template <class F>
+    void Place(Slot &slot, F &&f, false_type)
+    {
+        typedef typename decay<F>::type C;
+        Place(slot, Boxed<C> { unique_ptr<C>(new C(std::forward<F>(f))) }, true_type());
+    }
+    // Counts a Notify in progress, the outermost one settles the array when it leaves, also by exception
+    struct NotifyGuard
+    {
+        ObserverRegistry *registry;
+        NotifyGuard(ObserverRegistry *r) : registry(r) { registry->notifying++; }
+        ~NotifyGuard()
+        {
+            if (--registry->notifying == 0 && (registry->dead > 0 || !registry->added.empty()))
+            { registry->Settle(); }
+        }
+    };
+    // Move the last slot into slot "i"
+    void RemoveAt(size_t i)
+    {
+        if (i + 1 < slots.size())
+        {
+            slots[i] = std::move(slots.back());
+            if (slots[i].handle != Dead) { handles[slots[i].handle].slot = i; }
+        }
+        slots.pop_back();
+    }
+    // Move added slots in and drop the dead ones
+    void Settle()
+    {
+        for (size_t i = 0; i < added.size(); i++)
+        {
+            if (added[i].handle != Dead) { handles[added[i].handle].slot = slots.size(); }
+            slots.push_back(std::move(added[i]));
+        }
+        added.clear();
+        for (size_t i = 0; i < slots.size() && dead > 0; )
+        {
+            if (slots[i].handle != Dead) { i++; continue; }
+            RemoveAt(i);
+            dead--;
+        }
+    }
+public:
+    ObserverRegistry() : dead(0), notifying(0) { }
+    ObserverRegistry(const ObserverRegistry&) = delete;
+    ObserverRegistry &operator=(const ObserverRegistry&) = delete;
+
+    template <class F>
+    Token Subscribe(F &&f)
+    {
+        typedef typename decay<F>::type C;
+        uint32_t id;
+        if (freeHandles.empty()) { id = handles.size(); handles.push_back(Handle { 0, 1 }); }
+        else { id = freeHandles.back(); freeHandles.pop_back(); }
+        // Appending while notifying could move the slot being called
+        vector<Slot> &to = notifying ? added : slots;
+        handles[id].slot = slots.size() + (notifying ? added.size() : 0);
+        to.push_back(Slot());
+        Slot &slot = to.back();
+        slot.handle = id;
+        Place(slot, std::forward<F>(f), Fits<C>());
+        return Token(id, handles[id].generation);
+    }
+    // False for a token already unsubscribed
+    bool Unsubscribe(Token token)
+    {
+        if (token.id >= handles.size() || handles[token.id].generation != token.generation) { return false; }
+        Handle &h = handles[token.id];
+        h.generation++;
+        freeHandles.push_back(token.id);
+        if (!notifying)
+        {
+            RemoveAt(h.slot);
+            return true;
+        }
+        Slot &slot = (h.slot < slots.size()) ? slots[h.slot] : added[h.slot - slots.size()];
+        slot.invoke = &Skip;
+        slot.handle = Dead;
+        dead++;
+        return true;
+    }
+    size_t Size()
+    { return slots.size() + added.size() - dead; }
+    void Notify(Arg arg)
+    {
+        NotifyGuard guard(this);
+        size_t n = slots.size();
+        for (size_t i = 0; i < n; i++) { slots[i].invoke(slots[i].buf, arg); }
+    }
+};
+
+template <class Arg>
+template <class F>
+const typename ObserverRegistry<Arg>::Ops ObserverRegistry<Arg>::OpsOf<F>::table =
+    { &OpsOf<F>::Invoke, &OpsOf<F>::Move, &OpsOf<F>::Destroy };
 
 // The target object
 class BankAccount
 {
+public:
+    typedef ObserverRegistry<BankAccount*>::Token Token;
 private:
-    // List of registered observers
-    vector<Emailer*> emailers;
-    vector<Mobile*>  phoneNumbers;
+    // Registered observers, anything which can be called with the account
+    ObserverRegistry<BankAccount*> observers;
     // Other members
     double _money;
 
 public:
-    // Register method
-    void AddEmailer(Emailer *value)
-    { emailers.push_back(value); }
-    void AddPhoneNumber(Mobile *value)
-    { phoneNumbers.push_back(value); }
+    // Register method, the token unregisters again
+    template <class F>
+    Token Subscribe(F &&observer)
+    { return observers.Subscribe(std::forward<F>(observer)); }
+    bool Unsubscribe(Token token)
+    { return observers.Unsubscribe(token); }
 
     // Other member methods
     void SetMoney(double value)
@@ -47,9 +243,9 @@ public:
     double GetMoney()
     { return _money; }
 
-    // Notify trigger
-    // To avoid "incomplete type" error, put define to outside
-    void WithDraw();
+    // Notify all registered observers
+    void WithDraw()
+    { observers.Notify(this); }
 };
 
 // Observer
@@ -76,30 +272,139 @@ public:
     { cout << "Notified : Phone number is " << _phoneNumber << ", You withdraw " << ba->GetMoney() << endl; }
 };
 
-// Notify all registered observers
-void BankAccount::WithDraw()
+// Observers of the benchmark, they add up what they're told instead of printing
+struct EmailTally
+{
+    double total;
+    void SendEmail(BankAccount *ba) { total += ba->GetMoney(); }
+};
+struct MobileTally
+{
+    long calls;
+    double total;
+    void SendNotification(BankAccount *ba) { calls++; total += ba->GetMoney(); }
+};
+
+// The subject as it was, a vector and a loop per observer type
+class PerTypeAccount : public BankAccount
 {
-    for(vector<Emailer*>::iterator i = emailers.begin(); i != emailers.end(); i++)
-    { (*i)->SendEmail(this); }
-    for(vector<Mobile*>::iterator i = phoneNumbers.begin(); i != phoneNumbers.end(); i++)
-    { (*i)->SendNotification(this); }
+public:
+    vector<EmailTally*> emailers;
+    vector<MobileTally*> phoneNumbers;
+    void WithDraw()
+    {
+        for (vector<EmailTally*>::iterator i = emailers.begin(); i != emailers.end(); i++)
+        { (*i)->SendEmail(this); }
+        for (vector<MobileTally*>::iterator i = phoneNumbers.begin(); i != phoneNumbers.end(); i++)
+        { (*i)->SendNotification(this); }
+    }
+};
+
+// Nanoseconds per observer called, for 10 to 100K observers, half of each type, 100M calls each
+// Per type vectors against the registry and against a vector of std::function.
+// Then the time to unsubscribe all of them in random order.
+void BenchNotify(long calls)
+{
+    cout << "Notify benchmark: " << calls << " calls per size" << endl;
+    for (size_t n = 10; n <= 100000; n *= 10)
+    {
+        vector<EmailTally> emails(n / 2);
+        vector<MobileTally> mobiles(n - n / 2);
+        PerTypeAccount account;
+        account.SetMoney(1);
+        vector<BankAccount::Token> tokens;
+        vector<function<void(BankAccount*)> > functions;
+        for (size_t i = 0; i < emails.size(); i++)
+        {
+            EmailTally *e = &emails[i];
+            account.emailers.push_back(e);
+            tokens.push_back(account.Subscribe([e](BankAccount *ba) { e->SendEmail(ba); }));
+            functions.push_back([e](BankAccount *ba) { e->SendEmail(ba); });
+        }
+        for (size_t i = 0; i < mobiles.size(); i++)
+        {
+            MobileTally *m = &mobiles[i];
+            account.phoneNumbers.push_back(m);
+            tokens.push_back(account.Subscribe([m](BankAccount *ba) { m->SendNotification(ba); }));
+            functions.push_back([m](BankAccount *ba) { m->SendNotification(ba); });
+        }
+        long notifies = max(calls / (long)n, 1L);
+        cout << "  " << n << " observers:";
+        const char *names[] = { "per type", "registry", "std::function" };
+        for (int way = 0; way < 3; way++)
+        {
+            chrono::steady_clock::time_point start = chrono::steady_clock::now();
+            for (long k = 0; k < notifies; k++)
+            {
+                if (way == 0) { account.PerTypeAccount::WithDraw(); }
+                else if (way == 1) { account.BankAccount::WithDraw(); }
+                else { for (size_t i = 0; i < functions.size(); i++) { functions[i](&account); } }
+            }
+            double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / (notifies * n);
+            cout << " " << names[way] << " " << ns << " ns";
+        }
+        double expected = 3.0 * notifies;
+        if (emails[0].total != expected || mobiles[0].total != expected) { cout << " (WRONG TOTAL)"; }
+
+        // Unsubscribe everything, finding and erasing from the vectors against the tokens
+        vector<size_t> order(n);
+        for (size_t i = 0; i < n; i++) { order[i] = i; }
+        shuffle(order.begin(), order.end(), mt19937(42));
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        for (size_t i = 0; i < n; i++)
+        {
+            size_t k = order[i];
+            if (k < emails.size())
+            {
+                vector<EmailTally*> &v = account.emailers;
+                v.erase(find(v.begin(), v.end(), &emails[k]));
+            }
+            else
+            {
+                vector<MobileTally*> &v = account.phoneNumbers;
+                v.erase(find(v.begin(), v.end(), &mobiles[k - emails.size()]));
+            }
+        }
+        double vectors = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / n;
+        start = chrono::steady_clock::now();
+        for (size_t i = 0; i < n; i++) { account.Unsubscribe(tokens[order[i]]); }
+        double registry = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / n;
+        cout << ", unsubscribe per type " << vectors << " ns, registry " << registry << " ns" << endl;
+    }
 }
 
 // Test observer pattern
-int main()
+// Run "main bench [calls]" for the benchmark
+int main(int argc, char *argv[])
 {
+    if (argc > 1 && string(argv[1]) == "bench")
+    {
+        BenchNotify((argc > 2) ? atol(argv[2]) : 100000000);
+        return 0;
+    }
+
     // Target object
     BankAccount *ba = new BankAccount();
-    // Register observers
-    ba->AddEmailer(new Emailer("niubi@163.com"));
-    ba->AddEmailer(new Emailer("shenma@163.com"));
-    ba->AddPhoneNumber(new Mobile(15001234567));
-    ba->AddPhoneNumber(new Mobile(13984531209));
-    ba->AddPhoneNumber(new Mobile(16807894461));
-    ba->SetMoney(2000);       
+    // Register observers, any kind of observer goes through the same method
+    Emailer *emailers[] = { new Emailer("niubi@163.com"), new Emailer("shenma@163.com") };
+    Mobile *mobiles[] = { new Mobile(15001234567), new Mobile(13984531209), new Mobile(16807894461) };
+    for (Emailer *e : emailers)
+    { ba->Subscribe([e](BankAccount *account) { e->SendEmail(account); }); }
+    BankAccount::Token tokens[3];
+    for (int i = 0; i < 3; i++)
+    {
+        Mobile *m = mobiles[i];
+        tokens[i] = ba->Subscribe([m](BankAccount *account) { m->SendNotification(account); });
+    }
+    ba->SetMoney(2000);
     // Send notify
     ba->WithDraw();
 
+    // The second phone number unregistered, the last one takes its place
+    ba->Unsubscribe(tokens[1]);
+    ba->SetMoney(500);
+    ba->WithDraw();
+
     // The end
     return 0;
 }